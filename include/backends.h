@@ -0,0 +1,37 @@
+#pragma once
+#include "utils.h"
+
+/* Shared object holding the CUDA processor, see cuda_filters.h */
+#define BACKEND_CUDA_LIBRARY "libsobelf_cuda.so"
+
+/*
+ * A processor as seen by the command line and the cost model. Backends
+ * without a pipe are loaded on demand, the first time they are used.
+ * */
+typedef struct {
+  enum processor proc;
+  const char *name;  /* as given on the command line */
+  const char *label; /* as printed in the configuration */
+  pipe_fn pipe;
+  int parallel; /* spreads one frame over threads or a device */
+} backend;
+
+/* Backend called name, or NULL */
+const backend *backend_find(const char *name);
+const backend *backend_get(enum processor proc);
+
+/*
+ * Pipe of proc, loading its shared object if needed. Returns NULL (and
+ * says why on stderr) when the backend cannot be loaded.
+ * */
+pipe_fn backend_pipe(enum processor proc);
+
+/*
+ * Whether proc can run here. For CUDA the device nodes are checked first,
+ * so that neither the shared object nor the runtime is loaded on CPU-only
+ * machines.
+ * */
+int backend_available(enum processor proc);
+
+/* "default | opt | ..." list of the backend names */
+void backend_names(char *buf, int size);
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdio.h>
+
+#include "io_utils.h"
+
+/* One file to process in batch mode */
+typedef struct {
+  char *input;  /* Path of the input GIF */
+  char *output; /* Path of the output GIF */
+  long size;    /* Size of the input in bytes, used to schedule the queue */
+  unsigned char *data; /* Input read ahead of time, NULL to load the file */
+  size_t data_size;
+  io_queue *io; /* Writes the output in the background when not NULL */
+} batch_job;
+
+/*
+ * Callback processing a single job on the calling rank. It returns the time
+ * spent filtering the file or a negative value on failure.
+ * */
+typedef double (*batch_process)(batch_job *job, void *arg);
+
+int is_batch_input(char *input);
+batch_job *batch_collect(char *input, char *output, int *n_jobs);
+void batch_free(batch_job *jobs, int n_jobs);
+
+void batch_server(int n_workers, int n_jobs, batch_job *jobs, FILE *flog,
+                  batch_process process, void *arg);
+void batch_worker(batch_job *jobs, batch_process process, void *arg);
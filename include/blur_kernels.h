@@ -0,0 +1,39 @@
+#pragma once
+#include <limits.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* Radii with a fully unrolled blur kernel, others use the generic one */
+#define BLUR_KERNEL_MAX_SIZE 8
+
+typedef struct blur_kernel blur_kernel;
+
+/*
+ * Blur row j of p into new (columns size to width - size - 1) and return
+ * 1 if any channel moved by more than the threshold.
+ * */
+typedef int (*blur_row_fn)(const blur_kernel *kernel, const pixel *p,
+                           pixel *new, int j, int width);
+
+struct blur_kernel {
+  int size;
+  int threshold;
+  uint64_t div_mul; /* area division as (x * div_mul) >> div_shift */
+  int div_shift;
+  blur_row_fn row;
+};
+
+blur_kernel make_blur_kernel(int size, int threshold);
+
+/*
+ * Sobel edge test without the square root: sqrt(m) / 4 > threshold holds
+ * exactly when m > 16 * threshold^2 for the integer magnitudes m we get.
+ * */
+static inline int sobel_limit(int threshold) {
+  if (threshold < 0)
+    return -1;
+  return threshold > 4096 ? INT_MAX : 16 * threshold * threshold;
+}
+
+void sobel_row(const pixel *p, pixel *sobel, int j, int width, int limit);
@@ -3,6 +3,6 @@
 
 extern void cuda_apply_gray_filter_once(img *image);
 extern void cuda_apply_blur_filter_once(img *image, int size, int threshold);
-extern void cuda_apply_sobel_filter_once(img *image);
-extern void cuda_pipe(img *image);
+extern void cuda_apply_sobel_filter_once(img *image, int threshold);
+extern void cuda_pipe(img *image, const filter_params *params);
 extern int is_cuda_available(void);
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdio.h>
+
+#define DAEMON_MAX_CLIENTS 64
+/* Request lines, their newline included, are shorter than this */
+#define DAEMON_MAX_REQUEST 4096
+
+/*
+ * Callback running one request line ("input.gif output.gif [producer]
+ * [processor]") on the calling rank. It returns the time spent filtering
+ * or a negative value on failure.
+ * */
+typedef double (*daemon_process)(char *request, void *arg);
+
+void daemon_server(int n_workers, char *socket_path, FILE *flog,
+                   daemon_process process, void *arg);
+void daemon_worker(daemon_process process, void *arg);
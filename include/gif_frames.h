@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+
+#include "gif_mem.h"
+#include "utils.h"
+
+/*
+ * The frames of a GIF kept LZW-compressed in the file bytes, to be decoded
+ * one at a time on demand, by any thread. Filtered frames are collected
+ * LZW-compressed as well, with the fixed palette of gif_frames_write.
+ * */
+typedef struct {
+  const unsigned char *data; /* the whole file, owned by the caller */
+  size_t size;
+  int n_images;
+  size_t *offset;            /* of the image descriptor of each frame */
+  unsigned char *interlace;  /* rows of the frame stored in 4 passes */
+  unsigned char **encoded;   /* filtered frames, see gif_frames_encode */
+  size_t *encoded_size;
+  gif_membuf mem; /* reader of the index */
+} gif_frames;
+
+/*
+ * Index the frames of a GIF held in memory without decoding them. The
+ * returned animated_gif holds the descriptors and extensions like after
+ * DGifSlurp, with raster bits ready for map_pixels and frame buffers from
+ * alloc, left undecoded. With a NULL alloc only the sizes are filled, for
+ * ranks that never write the file. data must outlive both.
+ * */
+animated_gif *gif_frames_load(gif_frames *frames, const void *data,
+                              size_t size, pixel_alloc alloc,
+                              void *alloc_arg);
+
+/* Decode frame i into p, which holds its width * height pixels */
+int gif_frames_decode(const gif_frames *frames, int i, pixel *p);
+
+/*
+ * LZW-encode a filtered frame, whose pixels are gray, with the palette of
+ * 256 grays where index c is (c, c, c). Returns the LZW code size byte
+ * followed by the data sub-blocks, without the terminating empty block.
+ * */
+unsigned char *gif_frames_encode(const pixel *p, int width, int height,
+                                 int interlace, size_t *size);
+
+/*
+ * Write the GIF of g to filename with the 256-gray palette, its background
+ * color mapped to its gray, and the frames taken from frames->encoded
+ * without encoding them again. The frames are drawn opaque: the
+ * transparency flag of the graphics control blocks of g is cleared.
+ * */
+int gif_frames_write(const char *filename, GifFileType *g,
+                     const gif_frames *frames);
+
+void gif_frames_free(gif_frames *frames);
+
+/* Whole content of filename in a malloc'ed buffer, NULL on error */
+unsigned char *gif_frames_read_file(const char *filename, size_t *size);
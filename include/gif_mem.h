@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+
+#include "gif_lib.h"
+
+/*
+ * A memory buffer a GIF can be decoded from (DGifOpen) or encoded
+ * into (EGifOpen) through the giflib user data hooks.
+ * */
+typedef struct {
+  unsigned char *data;
+  size_t size;     /* Bytes available (read) or written (write) */
+  size_t pos;      /* Read position */
+  size_t capacity; /* Allocated bytes when writing */
+  int fd;          /* File written by gif_mem_close_file, -1 if none */
+  int mapped;      /* data is a shared mapping of fd */
+} gif_membuf;
+
+int gif_mem_read(GifFileType *g, GifByteType *buf, int len);
+int gif_mem_write(GifFileType *g, const GifByteType *buf, int len);
+
+GifFileType *gif_mem_open_read(gif_membuf *mem, const void *data,
+                               size_t size, int *error);
+GifFileType *gif_mem_open_write(gif_membuf *mem, int *error);
+
+/*
+ * Encode into filename through mem: the whole stream is kept in memory and
+ * written with a single write by gif_mem_close_file, or, with
+ * SOBELF_OUTPUT=mmap, encoded straight into the file mapped at size_hint
+ * bytes, grown as needed and truncated to its size once closed.
+ * */
+GifFileType *gif_mem_open_file(gif_membuf *mem, const char *filename,
+                               size_t size_hint, int *error);
+
+/* Same, always through the mapping, for outputs too large for memory */
+GifFileType *gif_mem_open_mapped(gif_membuf *mem, const char *filename,
+                                 size_t size_hint, int *error);
+
+/* Write out and release mem once the GIF was closed. Returns 0 on error. */
+int gif_mem_close_file(gif_membuf *mem, const char *filename);
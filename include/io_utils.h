@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Whole-file reads and writes running in the background, on io_uring when
+ * the kernel has it and on a small pool of threads otherwise (or when
+ * SOBELF_IO=threads). A queue belongs to the thread that opened it.
+ * */
+typedef struct io_queue io_queue;
+typedef struct io_file io_file;
+
+io_queue *io_open(void);
+
+/* "io_uring" or "threads" */
+const char *io_backend(const io_queue *q);
+
+/* Start reading the whole of path, NULL if it cannot be opened */
+io_file *io_read(io_queue *q, const char *path);
+
+/*
+ * Wait for a read of io_read and release f. Returns the malloc'ed contents,
+ * of *size bytes, or NULL when the read failed.
+ * */
+unsigned char *io_read_wait(io_queue *q, io_file *f, size_t *size);
+
+/*
+ * Start writing size bytes of data to path, data being freed once written.
+ * Returns 0 if path cannot be created. Failures of the write itself are
+ * reported when they complete and counted by io_close.
+ * */
+int io_write(io_queue *q, const char *path, unsigned char *data,
+             size_t size);
+
+/* Wait for the pending writes and release q. Returns 0 if any failed. */
+int io_close(io_queue *q);
@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+
+#include "utils.h"
+
+/* Alignment of every frame buffer, one cache line */
+#define MEM_ALIGN 64
+/* Buffers from this size on are aligned on and advised to huge pages */
+#define MEM_HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+ * Allocate size bytes for a frame or scratch buffer. The result is
+ * released with free. Nothing is touched, so the pages land on the NUMA
+ * node of the thread that first writes them.
+ * */
+void *mem_alloc(size_t size);
+
+/*
+ * Copy n items of item_bytes from src (or write zeros when src is NULL)
+ * into dst, splitting them in contiguous blocks over the threads like the
+ * static schedule of the OMP filters. Each page is then first touched by
+ * the thread that later works on it.
+ * */
+void mem_touch(void *dst, const void *src, size_t n, size_t item_bytes);
+
+/* pixel_alloc callback of load_pixels_from_gif: aligned, touched buffer */
+pixel *mem_pixel_alloc(size_t n_pixels, void *arg);
+
+/*
+ * Pin each OMP thread on its own CPU, threads being split in contiguous
+ * blocks over the sockets so that neighbouring rows stay on one node.
+ * This rank is node_rank of the node_size ranks sharing the node, which
+ * get disjoint CPUs. Prints the placement prefixed by label unless it is
+ * NULL. Returns 0 if pinning failed.
+ * */
+int mem_pin_threads(const char *label, int node_rank, int node_size);
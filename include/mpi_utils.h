@@ -1,5 +1,81 @@
 #pragma once
+#include "gif_frames.h"
 #include "utils.h"
 
-void mpi_worker(int rank, void (img*));
-void mpi_server(int n_workers, int n_images, img *images, int root);
+/* Tags of the frame protocol between mpi_server and the worker threads */
+#define MPI_TAG_REQUEST 1     /* first requests: {thread, n_threads} */
+#define MPI_TAG_RESULT 2      /* {thread, count, package...}, asks for more */
+#define MPI_TAG_SHARED_DONE 3 /* {thread, count, id...} back in their slots */
+#define MPI_TAG_ENCODED 4     /* {thread, count, {id, bytes}...} LZW blocks */
+#define MPI_TAG_FRAME 100     /* + thread: {count, {length, entry}...} */
+
+/* Batches each worker thread has asked for, the one it filters included */
+#define MPI_BATCHES_AHEAD 2
+
+/* Ints of an entry of a frame sent by index: {id, width, height} */
+#define MPI_FRAME_INDEX_SIZE 3
+
+/*
+ * Bytes of frames per batch when the network was never measured on this
+ * host, the normal case for explicit producers until an automatic run has
+ * cached the cost model, and the bounds of the measured target.
+ * */
+#define MPI_BATCH_BYTES (1 << 18)
+#define MPI_BATCH_MIN_BYTES (1 << 14)
+#define MPI_BATCH_MAX_BYTES (1 << 24)
+
+/* Shared window of the frames of the root, see mpi_server */
+typedef struct shared_frames shared_frames;
+
+/*
+ * Workers on the node of the root filter its frames in an MPI-3 shared
+ * window and exchange only their indices, the others get packages. With
+ * frames, every rank holds the compressed GIF: the workers decode the
+ * frames they are sent by index and return them LZW-encoded, see
+ * gif_frames_encode. Both functions are collective over MPI_COMM_WORLD.
+ *
+ * Run n_threads threads on this rank, each fetching batches of frames
+ * from the root on its own, one ahead of the batch it filters, until it
+ * is stopped with empty batches. Needs MPI_THREAD_MULTIPLE for more than
+ * one thread.
+ * */
+void mpi_worker(int n_threads, pipe_fn pipe, const filter_params *params,
+                const gif_frames *frames);
+
+/*
+ * Hand the frames out to the worker threads, in batches sized from the
+ * latency and bandwidth of the cost model. When no worker is waiting the
+ * root filters frames with pipe itself, from the end of the list so that
+ * the dispatch order is kept; a NULL pipe only dispatches. The workers
+ * hold a batch ahead, so they keep filtering while the root does. With frames,
+ * the root decodes only the frames it filters, and every filtered frame
+ * ends up encoded in frames->encoded rather than in images.
+ *
+ * Frames sent to the workers on the node of the root move to the shared
+ * window, images pointing to their slots, which stay valid until the
+ * window returned in shared is released with mpi_shared_free. With a
+ * NULL shared, every frame travels in messages.
+ *
+ * Only the exchange is by index: a worker still copies the frame out of
+ * its slot, filters the copy and copies the result back, as the pipes
+ * free or swap the buffer they are given, which window memory cannot be.
+ * Moved frames get no speculative copy: the slot is their only copy and
+ * its worker writes it back unsynchronised, so the root could neither
+ * pack it for another thread nor let that result land on it safely.
+ * */
+void mpi_server(int n_workers, int n_images, img *images, int root,
+                pipe_fn pipe, const filter_params *params,
+                gif_frames *frames, shared_frames **shared);
+
+/*
+ * Release the window of mpi_server, and the frames left in it. Collective
+ * with the workers on the node of the root, which wait for it at the end
+ * of mpi_worker. Does nothing on NULL.
+ * */
+void mpi_shared_free(shared_frames *shared);
+
+/*
+ * Whether an MPI launcher started this process in a job of several ranks.
+ * Singletons (plain ./sobelf, mpirun -n 1) skip MPI initialisation.
+ * */
+int mpi_launched(void);
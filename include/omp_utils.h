@@ -1,7 +1,14 @@
 #pragma once
 #include "utils.h"
 
-void omp_server(int n_images, img *images, void (*pipe)(img *));
+/*
+ * Run fn(arg) on a team of n_threads threads. A team of one calls fn
+ * directly: a parallel region of one thread would disable the OMP
+ * processors nested in the pipe.
+ * */
+void omp_run_team(int n_threads, void (*fn)(void *arg), void *arg);
+void omp_server(int n_images, img *images, pipe_fn pipe,
+                const filter_params *params);
 void omp_apply_gray_filter(img *image);
 void omp_apply_blur_filter(img *image, int size, int threshold);
-void omp_apply_sobel_filter(img *image);
+void omp_apply_sobel_filter(img *image, int threshold);
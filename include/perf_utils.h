@@ -0,0 +1,45 @@
+#pragma once
+#include <stdio.h>
+
+/* Stages the hardware counters are attributed to */
+enum perf_stage {
+  perf_gray,
+  perf_blur,
+  perf_sobel,
+  perf_palette, /* colormap of the output, see map_pixels */
+  perf_lzw,     /* encoding of the output frames */
+  n_perf_stages
+};
+
+/* Counters of one thread at the beginning of a stage */
+typedef struct {
+  double time;
+  long long cycles, instructions, misses;
+  int counted; /* the thread has its counters */
+} perf_sample;
+
+/* Doubles per stage in perf_totals */
+#define PERF_N_FIELDS 7
+
+/*
+ * Start counting, per thread, cycles, instructions and last level cache
+ * misses with perf_event_open, from the first stage each thread runs.
+ * Where the counters cannot be opened only times and pixels are kept.
+ * Stages running an OMP team count the thread that started it only.
+ * */
+void perf_start(void);
+
+void perf_begin(perf_sample *s);
+
+/* Attribute what the thread counted since s to stage, over n_pixels */
+void perf_end(const perf_sample *s, enum perf_stage stage, long n_pixels);
+
+/* Sums of this process, n_perf_stages * PERF_N_FIELDS doubles */
+void perf_totals(double *totals);
+
+/*
+ * Print one line per stage of sums (totals added over the ranks) to f, each
+ * prefixed by label: seconds, pixels, IPC, LLC misses per pixel and the
+ * GB/s the misses moved, per thread. Counters missing print as -1.
+ * */
+void perf_report(FILE *f, const char *label, const double *sums);
@@ -0,0 +1,7 @@
+#pragma once
+#include "utils.h"
+
+void omp_pipe(img *image, const filter_params *params);
+void opt_pipe(img *image, const filter_params *params);
+void default_pipe(img *image, const filter_params *params);
+void log_pipe(img *image, const filter_params *params);
@@ -0,0 +1,25 @@
+#pragma once
+#include "gif_frames.h"
+#include "utils.h"
+
+/*
+ * Filter the frames with MPI one-sided operations: the root exposes a
+ * window holding a frame counter and a copy of its frames, and every
+ * thread of every rank, the root included, claims the next frames with
+ * MPI_Fetch_and_op on the counter, reads them with MPI_Get and writes the
+ * results back with MPI_Put. No message goes through the root, which only
+ * copies the frames in and the results out of the window.
+ *
+ * Claims shrink with the frames left, half of a fair share of them per
+ * thread, so that the counter is hit rarely at first and the tail stays
+ * balanced. With frames, every rank holds the compressed GIF and decodes
+ * the frames it claims instead of reading them from the window.
+ *
+ * Collective over MPI_COMM_WORLD, every rank passing its n_threads and the
+ * same frame sizes in images; only the pixels of the root are used. The
+ * root with a NULL pipe filters nothing and releases the other ranks.
+ * Needs MPI_THREAD_MULTIPLE for more than one thread.
+ * */
+void rma_filter(int n_threads, int n_images, img *images, int root,
+                pipe_fn pipe, const filter_params *params,
+                const gif_frames *frames);
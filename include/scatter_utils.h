@@ -0,0 +1,20 @@
+#pragma once
+#include "gif_frames.h"
+#include "utils.h"
+
+/*
+ * Filter the frames with a split decided up front: every rank, the root
+ * included, gets a contiguous range of frames with a share of the pixels
+ * proportional to its n_threads. The root sends the ranges with one
+ * MPI_Scatterv, each rank filters its own with pipe on n_threads threads,
+ * and one MPI_Gatherv brings the results back into images. With frames,
+ * every rank holds the compressed GIF and decodes its range itself, so
+ * nothing is scattered.
+ *
+ * Collective over MPI_COMM_WORLD, every rank passing the same frame sizes
+ * in images; only the pixels of the root are used. The root with a NULL
+ * pipe filters nothing and releases the other ranks.
+ * */
+void scatter_filter(int n_threads, int n_images, img *images, int root,
+                    pipe_fn pipe, const filter_params *params,
+                    const gif_frames *frames);
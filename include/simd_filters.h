@@ -0,0 +1,17 @@
+#pragma once
+#include "utils.h"
+
+/*
+ * Largest blur radius the vector kernels handle: the (2 * size + 1)^2 sums
+ * of gray values must fit in 16-bit lanes.
+ * */
+#define SIMD_BLUR_MAX_SIZE 7
+
+/* Name of the blur kernel picked for this CPU ("avx2", "sse2", "scalar") */
+const char *simd_kernel_name(void);
+
+/*
+ * Gray, blur and sobel on a planar 16-bit copy of the frame, with the
+ * blur rows vectorised. Falls back to opt_pipe for unsupported radii.
+ * */
+void simd_pipe(img *image, const filter_params *params);
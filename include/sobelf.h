@@ -0,0 +1,60 @@
+#pragma once
+/*
+ * libsobelf: in-memory, reentrant interface to the sobel filtering pipeline.
+ *
+ * All the state lives in a sobelf_ctx. Contexts are independent from each
+ * other, so several threads may each use their own context concurrently,
+ * but a single context must not be used by two threads at the same time.
+ */
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  SOBELF_PROC_DEFAULT, /* reference sequential filters */
+  SOBELF_PROC_OPT,     /* optimized sequential filters */
+  SOBELF_PROC_OMP,     /* OpenMP filters, threads work on each frame */
+  SOBELF_PROC_SIMD     /* vectorised sequential filters */
+} sobelf_processor;
+
+typedef struct {
+  int n_threads;              /* threads used per call, <= 0 for all */
+  sobelf_processor processor; /* filters applied to each frame */
+  int pool_size;              /* frame buffers kept between calls */
+  int blur_size;              /* radius of the blur stencil */
+  int blur_threshold;         /* convergence threshold of the blur */
+  int sobel_threshold;        /* edge cutoff of the sobel filter */
+  int frame_diff;             /* write only the changed part of frames */
+} sobelf_options;
+
+typedef struct sobelf_ctx sobelf_ctx;
+
+/* Options matching the sobelf command line defaults */
+sobelf_options sobelf_default_options(void);
+
+sobelf_ctx *sobelf_create(const sobelf_options *options);
+void sobelf_destroy(sobelf_ctx *ctx);
+
+/*
+ * Filter every frame of the GIF held in data and encode the result into
+ * a new buffer returned in out (to be released with sobelf_free).
+ * Returns 0 on success, -1 otherwise (see sobelf_error).
+ */
+int sobelf_process_gif(sobelf_ctx *ctx, const void *data, size_t size,
+                       void **out, size_t *out_size);
+
+/*
+ * Filter one frame of interleaved 8-bit RGB pixels in place.
+ * Returns 0 on success, -1 otherwise (see sobelf_error).
+ */
+int sobelf_process_frame(sobelf_ctx *ctx, unsigned char *rgb, int width,
+                         int height);
+
+const char *sobelf_error(const sobelf_ctx *ctx);
+void sobelf_free(void *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#include "utils.h"
+
+/*
+ * Out-of-core filtering of a GIF whose frames are too large to be held as
+ * pixels. The frames are decoded into a scratch file mapped in memory
+ * (created in $TMPDIR, or /tmp, and unlinked at once), filtered by
+ * horizontal strips carrying the halo rows of their stencils, and encoded
+ * straight into a mapping of the output. Apart from a few rows, all the
+ * data lives in file pages the kernel can write back and reclaim, so the
+ * memory used does not grow with the image. The output is the one of the
+ * opt processor, without --frame-diff.
+ * */
+typedef struct strip_gif strip_gif;
+
+/* Decode filename into the scratch file, NULL on error */
+strip_gif *strip_load(const char *filename);
+
+int strip_n_images(const strip_gif *s);
+
+/* Run gray, blur and sobel on every frame. Returns 0 on error. */
+int strip_filter(strip_gif *s, const filter_params *params);
+
+/* Build the colormap as map_pixels and write s to filename, 0 on error */
+int strip_store(const char *filename, strip_gif *s);
+
+void strip_free(strip_gif *s);
@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * Timeline of the run in the Chrome trace event format, readable by
+ * chrome://tracing and Perfetto. Each thread records complete events in
+ * its own buffer, without locking; nothing is recorded until trace_start.
+ * */
+
+/* Start recording, timestamps being counted from this call */
+void trace_start(void);
+
+/* Seconds since trace_start, 0 when not recording */
+double trace_now(void);
+
+/*
+ * Record the span of stage name from start (a trace_now value) to now, on
+ * frame id, -1 when it covers no single frame. name must be a literal.
+ * */
+void trace_span(const char *name, int id, double start);
+
+/*
+ * Events of this process as JSON objects, each followed by ",\n", with
+ * pid as process id. Returns a malloc'ed buffer of size bytes, not
+ * terminated, or NULL when there is nothing to write.
+ * */
+char *trace_json(int pid, size_t *size);
+
+/* Write the events of trace_json of every process to filename */
+int trace_write(const char *filename, const char *events, size_t size);
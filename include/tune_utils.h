@@ -0,0 +1,59 @@
+#pragma once
+#include "utils.h"
+
+/* Version tag of the cache file, bumped whenever its layout changes */
+#define TUNE_CACHE_VERSION 1
+
+/*
+ * Cost model of this machine: filtering a frame of n pixels with processor
+ * p takes frame_cost[p] + n * pixel_cost[p] seconds, and shipping it to an
+ * MPI worker and back costs message_cost per message plus byte_cost per
+ * byte. Costs of processors that were not measured are negative.
+ * */
+typedef struct {
+  char host[64];
+  int n_threads; /* threads of the OMP measurements */
+  double frame_cost[n_processors];
+  double pixel_cost[n_processors];
+  double message_cost;
+  double byte_cost;
+} cost_model;
+
+/*
+ * Collective: the root loads the model from the cache file (see
+ * tune_cache_path), benchmarks what is missing or stale and saves it, then
+ * every rank receives it.
+ * */
+void tune_init(int rank, int n_workers);
+
+/* $SOBELF_COST_MODEL, or ~/.sobelf-<host>.model */
+void tune_cache_path(char *path, int size);
+
+/*
+ * Pick the producer and processor with the smallest estimated time for
+ * these frames, n_workers MPI ranks being available for the mpi, mpi-rma
+ * and mpi-static producers, and the number of frames each of their ranks
+ * filters at once. That split comes from the omp processor's measured
+ * speedup, as side by side frames share the rank's memory bandwidth.
+ * Returns the estimate in seconds.
+ * */
+double tune_decide(const img *images, int n_images, int n_workers,
+                   enum producer *prod, enum processor *proc,
+                   int *n_threads);
+
+/*
+ * Cheapest processor for one frame that can run on this rank, sequential
+ * ones only if !parallel.
+ * */
+enum processor tune_best_processor(long n_pixels, int parallel);
+
+/*
+ * Bytes worth sending in one MPI message: four times what the network
+ * moves during the latency of a message, so that the latency is at most a
+ * fifth of the transfer. Without tune_init, from the cached model of this
+ * host. -1 when the network was not measured.
+ * */
+double tune_batch_bytes(void);
+
+/* proc_auto: filter the frame with tune_best_processor */
+void tune_pipe(img *image, const filter_params *params);
@@ -1,7 +1,8 @@
 #pragma once
-#define CONV(l, c, nb_c) (l) * (nb_c) + (c)
+#define CONV(l, c, nb_c) ((size_t)(l) * (nb_c) + (c))
 #include <sys/time.h>
 #include "gif_lib.h"
+#include "gif_mem.h"
 
 /* Represent one pixel from the image */
 typedef struct pixel {
@@ -27,6 +28,40 @@ typedef struct {
   pixel *p;
 } img;
 
+/* Parameters of the filters */
+typedef struct {
+  int blur_size;       /* Radius of the blur stencil */
+  int blur_threshold;  /* Convergence threshold of the blur */
+  int sobel_threshold; /* Edge cutoff of the sobel filter */
+} filter_params;
+
+#define FILTER_PARAMS_DEFAULT {5, 20, 50}
+
+/* How the frames of an image are handed out */
+enum producer {
+  prod_invalid,
+  prod_def,
+  prod_mpi,
+  prod_omp,
+  prod_rma,    /* mpi with one-sided scheduling */
+  prod_static  /* mpi with a split decided up front */
+};
+
+/* Which chain of filters runs on each frame */
+enum processor {
+  proc_invalid,
+  proc_def,
+  proc_opt,
+  proc_omp,
+  proc_cuda,
+  proc_simd,
+  proc_auto, /* picked per frame from the cost model */
+  n_processors
+};
+
+/* A pipe applies the whole chain of filters to one image */
+typedef void (*pipe_fn)(img *image, const filter_params *params);
+
 /*
  * An image packege is an integer array representation
  * of an img to help with efficient mpi message passing
@@ -38,13 +73,30 @@ typedef int *img_pkg;
 
 void pkg2img(img_pkg pkg, img *image, int *sender_rank);
 void img2pkg(img image, img_pkg pkg, int sender_rank) ;
-int sizeofimg(img image);
-int sizeofp(int pkg_size);
+long sizeofimg(img image);
+long sizeofp(long pkg_size);
 
 void printimg(img image); 
 
+/* Allocator of frame buffers of n_pixels pixels */
+typedef pixel *(*pixel_alloc)(size_t n_pixels, void *arg);
+
 animated_gif *load_pixels(char *filename);
+animated_gif *load_pixels_mem(gif_membuf *mem, const void *data,
+                              size_t size);
+animated_gif *load_pixels_from_gif(GifFileType *g, pixel_alloc alloc,
+                                   void *alloc_arg);
 int output_modified_read_gif(char *filename, GifFileType *g);
-int store_pixels(char *filename, animated_gif *image);
+int output_modified_gif(GifFileType *g2, GifFileType *g);
+int map_pixels(animated_gif *image);
+
+/*
+ * Encode image into filename, or into mem->data to be released with free.
+ * With frame_diff, each frame is written as the rectangle that changed
+ * since the frame before it, where the frames allow it.
+ */
+int store_pixels(char *filename, animated_gif *image, int frame_diff);
+int store_pixels_mem(gif_membuf *mem, animated_gif *image, int frame_diff);
+void free_pixels(animated_gif *image);
 
 int test_pkg_img(void);
@@ -7,9 +7,10 @@ PROC=""
 LOG_FILE="sobelf.log"
 INPUT_DIR=images/original
 OUTPUT_DIR=images/processed
+BATCH=0
 
 # Parse arguments
-while getopts ":n:N:c:p:j:l:i:o:" opt; do
+while getopts ":n:N:c:p:j:l:i:o:b" opt; do
   case $opt in
     n) n=$OPTARG ;;
     N) N=$OPTARG ;;
@@ -19,6 +20,7 @@ while getopts ":n:N:c:p:j:l:i:o:" opt; do
     l) LOG_FILE=$OPTARG ;;
     i) INPUT_DIR=$OPTARG ;;
     o) OUTPUT_DIR=$OPTARG ;;
+    b) BATCH=1 ;;
     \?) echo "Invalid option -$OPTARG" >&2
         exit 1
         ;;
@@ -32,6 +34,11 @@ make;
 
 mkdir $OUTPUT_DIR 2>/dev/null
 export OMP_NUM_THREADS=$c
+if [ $BATCH -eq 1 ]; then
+    echo "Running batch on $INPUT_DIR -> $OUTPUT_DIR"
+    salloc -N $N -n $n -c $c mpirun --bind-to none ./sobelf $INPUT_DIR $OUTPUT_DIR $LOG_FILE $PROD $PROC
+    exit
+fi
 for i in $INPUT_DIR/*gif ; do
     DEST=$OUTPUT_DIR/`basename $i .gif`-sobel.gif
     echo "Running test on $i -> $DEST"
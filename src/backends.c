@@ -0,0 +1,125 @@
+#include "backends.h"
+#include "pipes.h"
+#include "simd_filters.h"
+#include "tune_utils.h"
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const backend backends[] = {
+    {proc_def, "default", "default", default_pipe, 0},
+    {proc_opt, "opt", "optimized default", opt_pipe, 0},
+    {proc_omp, "omp", "OMP", omp_pipe, 1},
+    {proc_simd, "simd", "SIMD", simd_pipe, 0},
+    {proc_cuda, "cuda", "CUDA", NULL, 1},
+    {proc_auto, "auto", "auto (per frame)", tune_pipe, 1},
+};
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* CUDA shared object: -1 not tried yet, 0 unusable, 1 loaded */
+static int cuda_state = -1;
+static pipe_fn cuda_pipe_fn;
+
+const backend *backend_find(const char *name) {
+  for (size_t i = 0; i < N_BACKENDS; i++)
+    if (!strcmp(backends[i].name, name))
+      return &backends[i];
+  return NULL;
+}
+
+const backend *backend_get(enum processor proc) {
+  for (size_t i = 0; i < N_BACKENDS; i++)
+    if (backends[i].proc == proc)
+      return &backends[i];
+  return NULL;
+}
+
+/*
+ * $SOBELF_CUDA_LIB, then the library next to the executable, then the
+ * dynamic linker search path.
+ * */
+static void *open_cuda_library(void) {
+  const char *env = getenv("SOBELF_CUDA_LIB");
+  char path[PATH_MAX];
+  ssize_t n;
+  void *handle;
+
+  if (env != NULL)
+    return dlopen(env, RTLD_NOW | RTLD_LOCAL);
+
+  n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (n > 0) {
+    path[n] = '\0';
+    char *slash = strrchr(path, '/');
+    if (slash != NULL &&
+        (size_t)(slash + 1 - path) + sizeof(BACKEND_CUDA_LIBRARY) <=
+            sizeof(path)) {
+      strcpy(slash + 1, BACKEND_CUDA_LIBRARY);
+      handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+      if (handle != NULL)
+        return handle;
+    }
+  }
+  return dlopen(BACKEND_CUDA_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+}
+
+static int load_cuda(void) {
+#pragma omp critical(backend_load)
+  if (cuda_state < 0) {
+    void *handle = open_cuda_library();
+    int (*available)(void) = NULL;
+
+    cuda_state = 0;
+    if (handle == NULL) {
+      fprintf(stderr, "Unable to load the CUDA backend: %s\n", dlerror());
+    } else {
+      /* dlsym returns object pointers, POSIX guarantees the conversion */
+      *(void **)&available = dlsym(handle, "is_cuda_available");
+      *(void **)&cuda_pipe_fn = dlsym(handle, "cuda_pipe");
+
+      if (available == NULL || cuda_pipe_fn == NULL)
+        fprintf(stderr, "Invalid CUDA backend, missing symbols\n");
+      else if (!available())
+        fprintf(stderr, "The CUDA backend found no device\n");
+      else
+        cuda_state = 1;
+    }
+  }
+  return cuda_state;
+}
+
+pipe_fn backend_pipe(enum processor proc) {
+  const backend *b = backend_get(proc);
+
+  if (b == NULL)
+    return NULL;
+  if (proc == proc_cuda)
+    return load_cuda() ? cuda_pipe_fn : NULL;
+  return b->pipe;
+}
+
+int backend_available(enum processor proc) {
+  if (proc != proc_cuda)
+    return backend_get(proc) != NULL;
+
+  /* No driver, no need to load anything */
+  if (cuda_state < 0 && access("/dev/nvidiactl", F_OK) != 0 &&
+      access("/dev/nvidia0", F_OK) != 0) {
+    cuda_state = 0;
+    return 0;
+  }
+  return load_cuda();
+}
+
+void backend_names(char *buf, int size) {
+  int len = 0;
+
+  buf[0] = '\0';
+  for (size_t i = 0; i < N_BACKENDS && len < size; i++)
+    len += snprintf(buf + len, size - len, "%s%s", i ? " | " : "",
+                    backends[i].name);
+}
@@ -0,0 +1,268 @@
+#include <dirent.h>
+#include <errno.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "batch_utils.h"
+
+#define BATCH_SUFFIX "-sobel.gif"
+/* Sent instead of the job to read ahead when the queue is empty */
+#define BATCH_NONE -2
+
+int is_batch_input(char *input) {
+  struct stat st;
+
+  if (input[0] == '@')
+    return 1;
+  return stat(input, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int has_gif_suffix(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && !strcmp(name + len - 4, ".gif");
+}
+
+/* Builds output_dir/<basename of input without .gif>-sobel.gif */
+static char *default_output(const char *input, const char *output_dir) {
+  const char *base = strrchr(input, '/');
+  base = base == NULL ? input : base + 1;
+
+  size_t base_len = strlen(base);
+  if (has_gif_suffix(base))
+    base_len -= 4;
+
+  size_t len = strlen(output_dir) + base_len + strlen(BATCH_SUFFIX) + 2;
+  char *out = malloc(len);
+  snprintf(out, len, "%s/%.*s%s", output_dir, (int)base_len, base,
+           BATCH_SUFFIX);
+  return out;
+}
+
+static int add_job(batch_job **jobs, int *n_jobs, int *capacity,
+                   const char *input, char *output) {
+  struct stat st;
+
+  if (stat(input, &st) != 0) {
+    fprintf(stderr, "Skipping %s: %s\n", input, strerror(errno));
+    free(output);
+    return 0;
+  }
+
+  if (*n_jobs == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 64;
+    *jobs = realloc(*jobs, *capacity * sizeof(batch_job));
+  }
+
+  memset(&(*jobs)[*n_jobs], 0, sizeof(batch_job));
+  (*jobs)[*n_jobs].input = strdup(input);
+  (*jobs)[*n_jobs].output = output;
+  (*jobs)[*n_jobs].size = st.st_size;
+  (*n_jobs)++;
+  return 1;
+}
+
+/* Largest files first, ties broken by name so every rank agrees */
+static int compare_jobs(const void *a, const void *b) {
+  const batch_job *ja = a, *jb = b;
+  if (ja->size != jb->size)
+    return ja->size < jb->size ? 1 : -1;
+  return strcmp(ja->input, jb->input);
+}
+
+/*
+ * Collect the jobs described by input. It is either a directory, in which
+ * case every .gif inside it is processed, or a list file prefixed with '@'
+ * holding one "input.gif [output.gif]" pair per line. Outputs that are not
+ * given explicitly are written to the output directory as
+ * <name>-sobel.gif. The jobs are sorted largest first.
+ * */
+batch_job *batch_collect(char *input, char *output, int *n_jobs) {
+  batch_job *jobs = NULL;
+  int capacity = 0;
+  char path[4096];
+
+  *n_jobs = 0;
+  mkdir(output, 0755);
+
+  if (input[0] == '@') {
+    FILE *flist = fopen(input + 1, "r");
+    char line[8192];
+
+    if (flist == NULL) {
+      fprintf(stderr, "Could not open list file (%s)\n", input + 1);
+      return NULL;
+    }
+
+    while (fgets(line, sizeof(line), flist) != NULL) {
+      char *in = strtok(line, " \t\r\n");
+      char *out = strtok(NULL, " \t\r\n");
+
+      if (in == NULL || in[0] == '#')
+        continue;
+      add_job(&jobs, n_jobs, &capacity, in,
+              out == NULL ? default_output(in, output) : strdup(out));
+    }
+    fclose(flist);
+  } else {
+    DIR *dir = opendir(input);
+    struct dirent *entry;
+
+    if (dir == NULL) {
+      fprintf(stderr, "Could not open input directory (%s)\n", input);
+      return NULL;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+      if (!has_gif_suffix(entry->d_name))
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", input, entry->d_name);
+      add_job(&jobs, n_jobs, &capacity, path, default_output(path, output));
+    }
+    closedir(dir);
+  }
+
+  qsort(jobs, *n_jobs, sizeof(batch_job), compare_jobs);
+  return jobs;
+}
+
+void batch_free(batch_job *jobs, int n_jobs) {
+  for (int i = 0; i < n_jobs; i++) {
+    free(jobs[i].input);
+    free(jobs[i].output);
+  }
+  free(jobs);
+}
+
+static void batch_log(FILE *flog, batch_job *job, double duration) {
+  if (duration < 0) {
+    fprintf(stderr, "Failed to process %s\n", job->input);
+    return;
+  }
+  fprintf(flog, "%s; %lf\n", job->input, duration);
+}
+
+/* Start reading the input of job while the one before it is processed */
+static io_file *batch_prefetch(io_queue *io, batch_job *jobs, int job) {
+  return io != NULL && job >= 0 ? io_read(io, jobs[job].input) : NULL;
+}
+
+/*
+ * Process job, from the input f read ahead when not NULL, its output being
+ * written in the background.
+ * */
+static double batch_run(io_queue *io, io_file *f, batch_job *job,
+                        batch_process process, void *arg) {
+  double duration;
+
+  if (f != NULL) {
+    job->data = io_read_wait(io, f, &job->data_size);
+    if (job->data == NULL)
+      return -1;
+  }
+
+  job->io = io;
+  duration = process(job, arg);
+  free(job->data);
+  job->data = NULL;
+  job->io = NULL;
+  return duration;
+}
+
+/* Send the next job of the queue to worker, 0 once the queue is empty */
+static int batch_send(int worker, int *next, int n_jobs) {
+  int job = *next < n_jobs ? (*next)++ : BATCH_NONE;
+
+  MPI_Send(&job, 1, MPI_INT, worker, 0, MPI_COMM_WORLD);
+  return job != BATCH_NONE;
+}
+
+/*
+ * Dispatch the jobs to the workers through a shared queue: every worker gets
+ * the next job index as soon as it reports the previous one, so the largest
+ * files start first and the small ones fill the gaps at the end. Each
+ * worker holds one job ahead of the one it processes, so that its input is
+ * read meanwhile.
+ * Without workers the root processes the whole queue itself, reading the
+ * next file ahead in the same way.
+ * */
+void batch_server(int n_workers, int n_jobs, batch_job *jobs, FILE *flog,
+                  batch_process process, void *arg) {
+  double result[2]; /* [job index, duration] */
+  MPI_Status status;
+  int next = 0;
+  int *ahead; /* the worker waits for the job after its current one */
+
+  if (n_workers <= 0) {
+    io_queue *io = io_open();
+    io_file *f = n_jobs > 0 ? batch_prefetch(io, jobs, 0) : NULL;
+
+    for (int i = 0; i < n_jobs; i++) {
+      io_file *following =
+          i + 1 < n_jobs ? batch_prefetch(io, jobs, i + 1) : NULL;
+
+      batch_log(flog, &jobs[i], batch_run(io, f, &jobs[i], process, arg));
+      f = following;
+    }
+    if (io != NULL)
+      io_close(io);
+    return;
+  }
+
+  // sending one job to each worker, then the one it reads ahead
+  ahead = calloc(n_workers + 1, sizeof(int));
+  for (int w = 1; w <= n_workers && next < n_jobs; w++) {
+    MPI_Send(&next, 1, MPI_INT, w, 0, MPI_COMM_WORLD);
+    next++;
+    ahead[w] = 1;
+  }
+  for (int w = 1; w <= n_workers; w++)
+    if (ahead[w])
+      ahead[w] = batch_send(w, &next, n_jobs);
+
+  // recv-send loop for dynamic allocation
+  for (int done = 0; done < n_jobs; done++) {
+    MPI_Recv(result, 2, MPI_DOUBLE, MPI_ANY_SOURCE, MPI_ANY_TAG,
+             MPI_COMM_WORLD, &status);
+    batch_log(flog, &jobs[(int)result[0]], result[1]);
+
+    if (ahead[status.MPI_SOURCE])
+      ahead[status.MPI_SOURCE] = batch_send(status.MPI_SOURCE, &next, n_jobs);
+  }
+  free(ahead);
+}
+
+void batch_worker(batch_job *jobs, batch_process process, void *arg) {
+  io_queue *io = io_open();
+  double result[2];
+  int job, next;
+  io_file *f;
+
+  // receive the index of the first job, negative means we are done
+  MPI_Recv(&job, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
+           MPI_STATUS_IGNORE);
+  f = batch_prefetch(io, jobs, job);
+
+  while (job >= 0) {
+    // the job after this one, read while this one is processed
+    MPI_Recv(&next, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    io_file *following = batch_prefetch(io, jobs, next);
+
+    result[0] = job;
+    result[1] = batch_run(io, f, &jobs[job], process, arg);
+    MPI_Send(result, 2, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+
+    job = next;
+    f = following;
+    // once the queue is empty only the end is left to receive
+    if (job == BATCH_NONE)
+      MPI_Recv(&job, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+  }
+
+  if (io != NULL)
+    io_close(io);
+}
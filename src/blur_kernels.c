@@ -0,0 +1,142 @@
+#include "blur_kernels.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+/*
+ * Blur kernel specialised for a radius known at compile time: the stencil
+ * loops are fully unrolled and the division by the area is by a constant,
+ * which the compiler turns into a multiply-shift.
+ */
+#define BLUR_ROW_KERNEL(R)                                                     \
+  static int blur_row_r##R(const blur_kernel *kernel, const pixel *p,          \
+                           pixel *new, int j, int width) {                     \
+    const int threshold = kernel->threshold;                                   \
+    int changed = 0;                                                           \
+                                                                               \
+    for (int k = R; k < width - R; k++) {                                      \
+      int t_r = 0;                                                             \
+      int t_g = 0;                                                             \
+      int t_b = 0;                                                             \
+                                                                               \
+      _Pragma("GCC unroll 17") for (int stencil_j = -R; stencil_j <= R;        \
+                                    stencil_j++) {                             \
+        _Pragma("GCC unroll 17") for (int stencil_k = -R; stencil_k <= R;      \
+                                      stencil_k++) {                           \
+          t_r += p[CONV(j + stencil_j, k + stencil_k, width)].r;               \
+          t_g += p[CONV(j + stencil_j, k + stencil_k, width)].g;               \
+          t_b += p[CONV(j + stencil_j, k + stencil_k, width)].b;               \
+        }                                                                      \
+      }                                                                        \
+                                                                               \
+      pixel *n = &new[CONV(j, k, width)];                                      \
+      const pixel *o = &p[CONV(j, k, width)];                                  \
+      n->r = t_r / ((2 * R + 1) * (2 * R + 1));                                \
+      n->g = t_g / ((2 * R + 1) * (2 * R + 1));                                \
+      n->b = t_b / ((2 * R + 1) * (2 * R + 1));                                \
+                                                                               \
+      changed |= abs(n->r - o->r) > threshold ||                               \
+                 abs(n->g - o->g) > threshold || abs(n->b - o->b) > threshold; \
+    }                                                                          \
+    return changed;                                                            \
+  }
+
+BLUR_ROW_KERNEL(1)
+BLUR_ROW_KERNEL(2)
+BLUR_ROW_KERNEL(3)
+BLUR_ROW_KERNEL(4)
+BLUR_ROW_KERNEL(5)
+BLUR_ROW_KERNEL(6)
+BLUR_ROW_KERNEL(7)
+BLUR_ROW_KERNEL(8)
+
+static const blur_row_fn blur_rows[BLUR_KERNEL_MAX_SIZE + 1] = {
+    NULL,         blur_row_r1, blur_row_r2, blur_row_r3, blur_row_r4,
+    blur_row_r5, blur_row_r6, blur_row_r7, blur_row_r8};
+
+/* Any radius, dividing with the reciprocal computed by make_blur_kernel */
+static int blur_row_generic(const blur_kernel *kernel, const pixel *p,
+                            pixel *new, int j, int width) {
+  const int size = kernel->size;
+  const int threshold = kernel->threshold;
+  const uint64_t mul = kernel->div_mul;
+  const int shift = kernel->div_shift;
+  int changed = 0;
+
+  for (int k = size; k < width - size; k++) {
+    int t_r = 0;
+    int t_g = 0;
+    int t_b = 0;
+
+    for (int stencil_j = -size; stencil_j <= size; stencil_j++) {
+      for (int stencil_k = -size; stencil_k <= size; stencil_k++) {
+        t_r += p[CONV(j + stencil_j, k + stencil_k, width)].r;
+        t_g += p[CONV(j + stencil_j, k + stencil_k, width)].g;
+        t_b += p[CONV(j + stencil_j, k + stencil_k, width)].b;
+      }
+    }
+
+    pixel *n = &new[CONV(j, k, width)];
+    const pixel *o = &p[CONV(j, k, width)];
+    n->r = (t_r * mul) >> shift;
+    n->g = (t_g * mul) >> shift;
+    n->b = (t_b * mul) >> shift;
+
+    changed |= abs(n->r - o->r) > threshold || abs(n->g - o->g) > threshold ||
+               abs(n->b - o->b) > threshold;
+  }
+  return changed;
+}
+
+/*
+ * Select the blur kernel for a radius. The generic one divides by the
+ * area a with m = ceil(2^(32 + l) / a), l = ceil(log2(a)), which is exact
+ * for every non negative 32-bit sum.
+ */
+blur_kernel make_blur_kernel(int size, int threshold) {
+  blur_kernel kernel;
+  uint64_t area = (uint64_t)(2 * size + 1) * (2 * size + 1);
+  int l = 0;
+
+  while ((1ull << l) < area)
+    l++;
+
+  kernel.size = size;
+  kernel.threshold = threshold;
+  kernel.div_shift = 32 + l;
+  kernel.div_mul = ((1ull << kernel.div_shift) + area - 1) / area;
+  kernel.row = size >= 1 && size <= BLUR_KERNEL_MAX_SIZE ? blur_rows[size]
+                                                        : blur_row_generic;
+  return kernel;
+}
+
+void sobel_row(const pixel *p, pixel *sobel, int j, int width, int limit) {
+  for (int k = 1; k < width - 1; k++) {
+    int pixel_blue_no, pixel_blue_n, pixel_blue_ne;
+    int pixel_blue_so, pixel_blue_s, pixel_blue_se;
+    int pixel_blue_o, pixel_blue_e;
+
+    int deltaX_blue;
+    int deltaY_blue;
+
+    pixel_blue_no = p[CONV(j - 1, k - 1, width)].b;
+    pixel_blue_n = p[CONV(j - 1, k, width)].b;
+    pixel_blue_ne = p[CONV(j - 1, k + 1, width)].b;
+    pixel_blue_so = p[CONV(j + 1, k - 1, width)].b;
+    pixel_blue_s = p[CONV(j + 1, k, width)].b;
+    pixel_blue_se = p[CONV(j + 1, k + 1, width)].b;
+    pixel_blue_o = p[CONV(j, k - 1, width)].b;
+    pixel_blue_e = p[CONV(j, k + 1, width)].b;
+
+    deltaX_blue = -pixel_blue_no + pixel_blue_ne - 2 * pixel_blue_o +
+                  2 * pixel_blue_e - pixel_blue_so + pixel_blue_se;
+
+    deltaY_blue = pixel_blue_se + 2 * pixel_blue_s + pixel_blue_so -
+                  pixel_blue_ne - 2 * pixel_blue_n - pixel_blue_no;
+
+    int edge = deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue > limit;
+    sobel[CONV(j, k, width)].r = edge * 255;
+    sobel[CONV(j, k, width)].g = edge * 255;
+    sobel[CONV(j, k, width)].b = edge * 255;
+  }
+}
@@ -1,21 +1,34 @@
 #include "utils.h"
 
 #include <cuda_runtime.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #define SOBEL_R 1
 
 #define THREADS_PER_BLOCK 256
 
+/* Grid of the per-pixel kernels, which loop over the rest of the frame */
+#define MAX_BLOCKS 65535
+
 #define TILE_HEIGHT 16
 #define TILE_WIDTH 16
 
 #define BLOCK_WIDTH (TILE_WIDTH + (2 * SOBEL_R))
 #define BLOCK_HEIGHT (TILE_HEIGHT + (2 * SOBEL_R))
 
-__global__ void gray_filter_kernel(pixel *p, unsigned size) {
-  unsigned i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < size) {
+/* Blocks covering n pixels, capped: the kernels stride over the grid */
+static unsigned grid_size(size_t n) {
+  const size_t blocks = (n + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK;
+  if (blocks == 0)
+    return 1;
+  return blocks < MAX_BLOCKS ? (unsigned)blocks : MAX_BLOCKS;
+}
+
+__global__ void gray_filter_kernel(pixel *p, size_t size) {
+  const size_t stride = (size_t)gridDim.x * blockDim.x;
+  for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += stride) {
     int moy = (p[i].r + p[i].g + p[i].b) / 3;
     moy = max(0, min(255, moy));
 
@@ -27,13 +40,13 @@ __global__ void gray_filter_kernel(pixel *p, unsigned size) {
 
 // Inspired by Nvidia CUDA samples
 __global__ void sobel_filter_kernel(pixel *p, pixel *new_p, int width,
-                                    int height) {
+                                    int height, int threshold) {
   __shared__ int smem[BLOCK_HEIGHT * BLOCK_WIDTH];
 
   int x = blockIdx.x * TILE_WIDTH + threadIdx.x - SOBEL_R;
   int y = blockIdx.y * TILE_HEIGHT + threadIdx.y - SOBEL_R;
 
-  unsigned i = y * width + x;
+  ptrdiff_t i = (ptrdiff_t)y * width + x;
   unsigned smem_i = threadIdx.y * BLOCK_WIDTH + threadIdx.x;
 
   if (x >= 0 && x < width && y >= 0 && y < height) {
@@ -57,9 +70,9 @@ __global__ void sobel_filter_kernel(pixel *p, pixel *new_p, int width,
 
     float new_val = sqrt(delta_x * delta_x + delta_y * delta_y) / 4;
 
-    new_p[i].r = (new_val > 50) * 255;
-    new_p[i].g = (new_val > 50) * 255;
-    new_p[i].b = (new_val > 50) * 255;
+    new_p[i].r = (new_val > threshold) * 255;
+    new_p[i].g = (new_val > threshold) * 255;
+    new_p[i].b = (new_val > threshold) * 255;
   }
 }
 
@@ -72,7 +85,7 @@ __global__ void horizontal_pass(pixel *p, pixel *p_out, int width, int height,
   }
 
   int sum = 0;
-  int idx = thread_idx * width;
+  size_t idx = (size_t)thread_idx * width;
   for (int i = 0; i < 2 * size + 1; i++) {
     sum += p[idx + i].r;
   }
@@ -97,16 +110,16 @@ __global__ void vertical_pass(pixel *p, pixel *p_out, int width, int height,
   }
 
   for (int i = 0; i < 2 * size + 1; i++) {
-    sum += p[idx + width * i].r;
+    sum += p[idx + (size_t)width * i].r;
   }
 
   for (int i = 0; i < height - 2 * size; i++) {
-    p_out[idx + width * (i + size)].r = sum;
-    p_out[idx + width * (i + size)].g = sum;
-    p_out[idx + width * (i + size)].b = sum;
+    p_out[idx + (size_t)width * (i + size)].r = sum;
+    p_out[idx + (size_t)width * (i + size)].g = sum;
+    p_out[idx + (size_t)width * (i + size)].b = sum;
 
-    sum += p[idx + width * (i + 2 * size + 1)].r;
-    sum -= p[idx + width * i].r;
+    sum += p[idx + (size_t)width * (i + 2 * size + 1)].r;
+    sum -= p[idx + (size_t)width * i].r;
   }
 }
 
@@ -119,25 +132,29 @@ __global__ void normalize_pixel_values(pixel *img, int width, int height,
     return;
   }
 
-  int idx = y * width + x;
+  size_t idx = (size_t)y * width + x;
   img[idx].r /= area;
   img[idx].g /= area;
   img[idx].b /= area;
 }
 
 // Inspired by cuda samples, modified for simplicity and our use case
-__global__ void reduce(pixel *orig_p, pixel *mod_p, int *out_flag, int n,
+__global__ void reduce(pixel *orig_p, pixel *mod_p, int *out_flag, size_t n,
                        int threshold) {
   __shared__ int sdata[THREADS_PER_BLOCK];
   unsigned int tid = threadIdx.x;
-  unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
-
-  if (i < n && (orig_p[i].r - mod_p[i].r > threshold ||
-                mod_p[i].r - orig_p[i].r > threshold)) {
-    sdata[tid] = 1;
-  } else {
-    sdata[tid] = 0;
+  const size_t stride = (size_t)gridDim.x * blockDim.x;
+  int changed = 0;
+
+  for (size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x; i < n;
+       i += stride) {
+    if (orig_p[i].r - mod_p[i].r > threshold ||
+        mod_p[i].r - orig_p[i].r > threshold) {
+      changed = 1;
+      break;
+    }
   }
+  sdata[tid] = changed;
   __syncthreads();
 
   for (unsigned int s = blockDim.x / 2; s > 0; s >>= 1) {
@@ -153,19 +170,17 @@ __global__ void reduce(pixel *orig_p, pixel *mod_p, int *out_flag, int n,
 }
 
 extern "C" void cuda_apply_gray_filter_once(img *image_d) {
-  const size_t block_size = THREADS_PER_BLOCK;
-  const size_t num_blocks =
-      (image_d->width * image_d->height + block_size - 1) / block_size;
-  gray_filter_kernel<<<num_blocks, block_size>>>(
-      image_d->p, image_d->width * image_d->height);
+  const size_t n = (size_t)image_d->width * image_d->height;
+  gray_filter_kernel<<<grid_size(n), THREADS_PER_BLOCK>>>(image_d->p, n);
 }
 
 extern "C" void cuda_apply_blur_filter_once(img *image, int size,
                                             int threshold) {
+  const size_t n = (size_t)image->width * image->height;
   pixel *temp_p_d = nullptr;
-  cudaMalloc(&temp_p_d, image->width * image->height * sizeof(pixel));
+  cudaMalloc(&temp_p_d, n * sizeof(pixel));
   pixel *new_p_d = nullptr;
-  cudaMalloc(&new_p_d, image->width * image->height * sizeof(pixel));
+  cudaMalloc(&new_p_d, n * sizeof(pixel));
 
   int *cont_flag_d = nullptr;
   cudaMalloc(&cont_flag_d, sizeof(int));
@@ -173,10 +188,8 @@ extern "C" void cuda_apply_blur_filter_once(img *image, int size,
   int cont_flag = 0;
   int n_iter = 0;
   do {
-    cudaMemcpy(new_p_d, image->p, image->width * image->height * sizeof(pixel),
-               cudaMemcpyDeviceToDevice);
-    cudaMemcpy(temp_p_d, image->p, image->width * image->height * sizeof(pixel),
-               cudaMemcpyDeviceToDevice);
+    cudaMemcpy(new_p_d, image->p, n * sizeof(pixel), cudaMemcpyDeviceToDevice);
+    cudaMemcpy(temp_p_d, image->p, n * sizeof(pixel), cudaMemcpyDeviceToDevice);
 
     // second dimension is used to blur either the bottom or top of the image
     // not yet implemented
@@ -201,7 +214,8 @@ extern "C" void cuda_apply_blur_filter_once(img *image, int size,
 
     // TODO: implement this using block y dimension
     const int lower_bar_height = (image->height + 9) / 10;
-    const int offset = image->width * (image->height - lower_bar_height);
+    const size_t offset =
+        (size_t)image->width * (image->height - lower_bar_height);
     horizontal_pass<<<num_hor_blocks, block_size>>>(
         image->p + offset, temp_p_d + offset, image->width, lower_bar_height,
         size);
@@ -212,12 +226,9 @@ extern "C" void cuda_apply_blur_filter_once(img *image, int size,
         new_p_d + offset, image->width, lower_bar_height, size,
         (2 * size + 1) * (2 * size + 1));
 
-    int num_reduction_blocks =
-        (image->width * image->height + block_size.x - 1) / block_size.x;
     cudaMemset(cont_flag_d, 0, sizeof(int));
-    reduce<<<num_reduction_blocks, block_size>>>(image->p, new_p_d, cont_flag_d,
-                                                 image->width * image->height,
-                                                 threshold);
+    reduce<<<grid_size(n), block_size>>>(image->p, new_p_d, cont_flag_d, n,
+                                         threshold);
     cudaMemcpy(&cont_flag, cont_flag_d, sizeof(int), cudaMemcpyDeviceToHost);
 
     pixel *temp = image->p;
@@ -235,44 +246,44 @@ extern "C" void cuda_apply_blur_filter_once(img *image, int size,
   cudaFree(cont_flag_d);
 }
 
-extern "C" void cuda_apply_sobel_filter_once(img *image) {
+extern "C" void cuda_apply_sobel_filter_once(img *image, int threshold) {
+  const size_t n = (size_t)image->width * image->height;
   pixel *new_p_d = nullptr;
-  cudaMalloc(&new_p_d, image->width * image->height * sizeof(pixel));
+  cudaMalloc(&new_p_d, n * sizeof(pixel));
   // TODO: Fix, this works but is not efficient. I tried doing it in the kernel
   // but it didn't work
-  cudaMemcpy(new_p_d, image->p, image->width * image->height * sizeof(pixel),
-             cudaMemcpyDeviceToDevice);
+  cudaMemcpy(new_p_d, image->p, n * sizeof(pixel), cudaMemcpyDeviceToDevice);
 
   const dim3 block_size(BLOCK_WIDTH, BLOCK_HEIGHT);
   const dim3 num_blocks((image->width + TILE_WIDTH - 1) / TILE_WIDTH,
                         (image->height + TILE_HEIGHT - 1) / TILE_HEIGHT);
-  sobel_filter_kernel<<<num_blocks, block_size>>>(image->p, new_p_d,
-                                                  image->width, image->height);
+  sobel_filter_kernel<<<num_blocks, block_size>>>(
+      image->p, new_p_d, image->width, image->height, threshold);
 
   cudaFree(image->p);
   image->p = new_p_d;
 }
 
-extern "C" void cuda_pipe(img *image) {
+extern "C" void cuda_pipe(img *image, const filter_params *params) {
   /* Allocate memory for the image on device*/
+  const size_t n = (size_t)image->width * image->height;
   img image_d = *image;
-  cudaMalloc(&image_d.p, image_d.width * image_d.height * sizeof(pixel));
-  cudaMemcpy(image_d.p, image->p, image->width * image->height * sizeof(pixel),
-             cudaMemcpyHostToDevice);
+  cudaMalloc(&image_d.p, n * sizeof(pixel));
+  cudaMemcpy(image_d.p, image->p, n * sizeof(pixel), cudaMemcpyHostToDevice);
 
   /* Convert the pixels into grayscale */
   cuda_apply_gray_filter_once(&image_d);
 
   /* Apply blur filter with convergence value */
-  cuda_apply_blur_filter_once(&image_d, 5, 20);
+  cuda_apply_blur_filter_once(&image_d, params->blur_size,
+                              params->blur_threshold);
 
   /* Apply sobel filter on pixels */
-  cuda_apply_sobel_filter_once(&image_d);
+  cuda_apply_sobel_filter_once(&image_d, params->sobel_threshold);
 
   /* Copy the pixels back to the host and frees memmory */
   cudaDeviceSynchronize();
-  cudaMemcpy(image->p, image_d.p, image->width * image->height * sizeof(pixel),
-             cudaMemcpyDeviceToHost);
+  cudaMemcpy(image->p, image_d.p, n * sizeof(pixel), cudaMemcpyDeviceToHost);
   cudaFree(image_d.p);
 }
 
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <malloc.h>
+#include <mpi.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon_utils.h"
+
+/* Frame buffers up to this size stay in the heap between jobs */
+#define DAEMON_HEAP_KEEP (1 << 30)
+
+typedef struct {
+  int fd;      /* -1 when the slot is free */
+  int pending; /* requests not answered yet */
+  int closing; /* peer hung up, close once nothing is pending */
+  int discarding; /* in a request too long, until its newline */
+  int len;
+  char buf[DAEMON_MAX_REQUEST];
+} daemon_client;
+
+typedef struct {
+  int client;
+  struct timeval start;
+  char request[DAEMON_MAX_REQUEST];
+} daemon_job;
+
+typedef struct {
+  daemon_job *jobs;
+  int head;
+  int size;
+  int capacity;
+} daemon_queue;
+
+static void queue_push(daemon_queue *q, daemon_job *job) {
+  if (q->size == q->capacity) {
+    int capacity = q->capacity ? 2 * q->capacity : 16;
+    daemon_job *jobs = malloc(capacity * sizeof(daemon_job));
+    for (int i = 0; i < q->size; i++)
+      jobs[i] = q->jobs[(q->head + i) % q->capacity];
+    free(q->jobs);
+    q->jobs = jobs;
+    q->head = 0;
+    q->capacity = capacity;
+  }
+  q->jobs[(q->head + q->size) % q->capacity] = *job;
+  q->size++;
+}
+
+static daemon_job queue_pop(daemon_queue *q) {
+  daemon_job job = q->jobs[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->size--;
+  return job;
+}
+
+static int open_socket(char *socket_path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long (%s)\n", socket_path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, DAEMON_MAX_CLIENTS) < 0) {
+    perror(socket_path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void close_client(daemon_client *client) {
+  close(client->fd);
+  client->fd = -1;
+  client->len = 0;
+  client->pending = 0;
+  client->closing = 0;
+  client->discarding = 0;
+}
+
+/* Answer a finished job and report its latency, from reception to reply */
+static void reply(daemon_client *clients, daemon_job *job, double duration,
+                  FILE *flog) {
+  daemon_client *client = &clients[job->client];
+  struct timeval now;
+  char answer[64];
+  double latency;
+  int len;
+
+  gettimeofday(&now, NULL);
+  latency = (now.tv_sec - job->start.tv_sec) +
+            ((now.tv_usec - job->start.tv_usec) / 1e6);
+
+  if (duration < 0) {
+    len = snprintf(answer, sizeof(answer), "error\n");
+    fprintf(stderr, "Failed request: %s\n", job->request);
+  } else {
+    len = snprintf(answer, sizeof(answer), "ok %lf %lf\n", duration, latency);
+    fprintf(flog, "%s; %lf; %lf\n", job->request, duration, latency);
+    fflush(flog);
+  }
+
+  if (write(client->fd, answer, len) != len)
+    client->closing = 1;
+  if (--client->pending == 0 && client->closing)
+    close_client(client);
+}
+
+/*
+ * Read what the client sent and queue every complete line. Returns 1 when
+ * the client asked the server to stop.
+ * */
+static int read_client(daemon_client *clients, int c, daemon_queue *queue) {
+  daemon_client *client = &clients[c];
+  int stop = 0;
+  ssize_t n;
+
+  n = read(client->fd, client->buf + client->len,
+           DAEMON_MAX_REQUEST - 1 - client->len);
+  if (n <= 0) {
+    if (client->pending == 0)
+      close_client(client);
+    else
+      client->closing = 1;
+    return 0;
+  }
+  client->len += n;
+  client->buf[client->len] = '\0';
+
+  char *line = client->buf, *eol;
+  while ((eol = strchr(line, '\n')) != NULL) {
+    *eol = '\0';
+    // the end of a request too long, already answered
+    if (client->discarding) {
+      client->discarding = 0;
+      line = eol + 1;
+      continue;
+    }
+    while (eol > line &&
+           (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t'))
+      *--eol = '\0';
+
+    if (!strcmp(line, "quit")) {
+      stop = 1;
+    } else if (line[0] != '\0') {
+      daemon_job job;
+      job.client = c;
+      gettimeofday(&job.start, NULL);
+      snprintf(job.request, sizeof(job.request), "%s", line);
+      queue_push(queue, &job);
+      client->pending++;
+    }
+    line = eol + 1;
+  }
+
+  // keep the partial line for the next read, fail it if it can never fit
+  client->len -= line - client->buf;
+  memmove(client->buf, line, client->len);
+  if (client->len == DAEMON_MAX_REQUEST - 1) {
+    client->len = 0;
+    if (!client->discarding) {
+      fprintf(stderr, "Request of %d bytes or more\n", DAEMON_MAX_REQUEST);
+      client->discarding = 1;
+      if (write(client->fd, "error\n", 6) != 6) {
+        if (client->pending == 0)
+          close_client(client);
+        else
+          client->closing = 1;
+      }
+    }
+  }
+
+  return stop;
+}
+
+/*
+ * Serve requests from a UNIX domain socket until a client sends "quit".
+ * Each line received is one job, answered with "ok <filter s> <latency s>"
+ * or "error"; lines of DAEMON_MAX_REQUEST bytes or more only get "error".
+ * Jobs are queued and dispatched to the worker ranks, which stay
+ * initialised between jobs; without workers the root runs them itself.
+ * */
+void daemon_server(int n_workers, char *socket_path, FILE *flog,
+                   daemon_process process, void *arg) {
+  daemon_client clients[DAEMON_MAX_CLIENTS];
+  struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+  int slots[DAEMON_MAX_CLIENTS + 1];
+  daemon_queue queue = {NULL, 0, 0, 0};
+  daemon_job *running = malloc((n_workers + 1) * sizeof(daemon_job));
+  int *idle = malloc((n_workers + 1) * sizeof(int));
+  int n_idle = n_workers;
+  int stop = 0;
+  int listen_fd;
+
+  listen_fd = open_socket(socket_path);
+  if (listen_fd < 0) {
+    free(running);
+    free(idle);
+    return;
+  }
+
+  /* Clients may leave before their answer, and freed frames should be
+   * reused by the next job instead of being returned to the system */
+  signal(SIGPIPE, SIG_IGN);
+  mallopt(M_MMAP_THRESHOLD, DAEMON_HEAP_KEEP);
+  mallopt(M_TRIM_THRESHOLD, DAEMON_HEAP_KEEP);
+
+  for (int i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+  for (int i = 0; i < n_workers; i++)
+    idle[i] = i + 1;
+
+  printf("Serving on %s with %d worker(s)\n", socket_path, n_workers);
+  fflush(stdout);
+
+  while (!stop || queue.size > 0 || n_idle < n_workers) {
+    int n_fds = 0;
+
+    if (!stop) {
+      fds[n_fds].fd = listen_fd;
+      fds[n_fds].events = POLLIN;
+      slots[n_fds++] = -1;
+    }
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      if (clients[i].fd < 0 || clients[i].closing)
+        continue;
+      fds[n_fds].fd = clients[i].fd;
+      fds[n_fds].events = POLLIN;
+      slots[n_fds++] = i;
+    }
+
+    // block on the sockets unless some worker may be answering
+    if (poll(fds, n_fds, n_idle < n_workers ? 1 : -1) < 0 && errno != EINTR)
+      break;
+
+    for (int i = 0; i < n_fds; i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      if (slots[i] >= 0) {
+        stop |= read_client(clients, slots[i], &queue);
+        continue;
+      }
+
+      int fd = accept(listen_fd, NULL, NULL);
+      int c = 0;
+      while (c < DAEMON_MAX_CLIENTS && clients[c].fd >= 0)
+        c++;
+      if (c == DAEMON_MAX_CLIENTS) {
+        close(fd);
+        continue;
+      }
+      clients[c].fd = fd;
+      clients[c].len = 0;
+      clients[c].pending = 0;
+      clients[c].closing = 0;
+      clients[c].discarding = 0;
+    }
+
+    if (n_workers <= 0) {
+      while (queue.size > 0) {
+        daemon_job job = queue_pop(&queue);
+        reply(clients, &job, process(job.request, arg), flog);
+      }
+      continue;
+    }
+
+    // collect the answers of the workers
+    for (;;) {
+      MPI_Status status;
+      double duration;
+      int flag;
+
+      MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+      if (!flag)
+        break;
+      MPI_Recv(&duration, 1, MPI_DOUBLE, status.MPI_SOURCE, status.MPI_TAG,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      reply(clients, &running[status.MPI_SOURCE], duration, flog);
+      idle[n_idle++] = status.MPI_SOURCE;
+    }
+
+    // hand the queued jobs to the idle workers
+    while (queue.size > 0 && n_idle > 0) {
+      int worker = idle[--n_idle];
+      int size;
+
+      running[worker] = queue_pop(&queue);
+      size = strlen(running[worker].request) + 1;
+      MPI_Send(&size, 1, MPI_INT, worker, 0, MPI_COMM_WORLD);
+      MPI_Send(running[worker].request, size, MPI_CHAR, worker, 0,
+               MPI_COMM_WORLD);
+    }
+  }
+
+  for (int i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    if (clients[i].fd >= 0)
+      close_client(&clients[i]);
+  close(listen_fd);
+  unlink(socket_path);
+  free(queue.jobs);
+  free(running);
+  free(idle);
+}
+
+void daemon_worker(daemon_process process, void *arg) {
+  char request[DAEMON_MAX_REQUEST];
+  double duration;
+  int size;
+
+  mallopt(M_MMAP_THRESHOLD, DAEMON_HEAP_KEEP);
+  mallopt(M_TRIM_THRESHOLD, DAEMON_HEAP_KEEP);
+
+  for (;;) {
+    // receive the size of the next request, negative means we are done
+    MPI_Recv(&size, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    if (size < 0)
+      return;
+
+    MPI_Recv(request, size, MPI_CHAR, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    duration = process(request, arg);
+    MPI_Send(&duration, 1, MPI_DOUBLE, 0, 0, MPI_COMM_WORLD);
+  }
+}
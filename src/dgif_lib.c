@@ -1103,7 +1103,7 @@ DGifSlurp(GifFileType *GifFile)
                       sp->ImageDesc.Width > (INT_MAX / sp->ImageDesc.Height)) {
                   return GIF_ERROR;
               }
-              ImageSize = sp->ImageDesc.Width * sp->ImageDesc.Height;
+              ImageSize = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height;
 
               if (ImageSize > (SIZE_MAX / sizeof(GifPixelType))) {
                   return GIF_ERROR;
@@ -1129,11 +1129,19 @@ DGifSlurp(GifFileType *GifFile)
 			   j < sp->ImageDesc.Height;
 			   j += InterlacedJumps[i]) {
 			  if (DGifGetLine(GifFile, 
-					  sp->RasterBits+j*sp->ImageDesc.Width, 
+					  sp->RasterBits+(size_t)j*sp->ImageDesc.Width, 
 					  sp->ImageDesc.Width) == GIF_ERROR)
 			      return GIF_ERROR;
 		      }
 	      }
+	      else if (ImageSize > INT_MAX) {
+		  /* DGifGetLine takes an int, larger frames go row by row */
+		  for (int j = 0; j < sp->ImageDesc.Height; j++)
+		      if (DGifGetLine(GifFile,
+				      sp->RasterBits+(size_t)j*sp->ImageDesc.Width,
+				      sp->ImageDesc.Width) == GIF_ERROR)
+			  return GIF_ERROR;
+	      }
 	      else {
 		  if (DGifGetLine(GifFile,sp->RasterBits,ImageSize)==GIF_ERROR)
 		      return (GIF_ERROR);
@@ -1126,14 +1126,14 @@ EGifSpew(GifFileType *GifFileOut)
 		     j < SavedHeight;
 		     j += InterlacedJumps[k]) {
 		    if (EGifPutLine(GifFileOut, 
-				    sp->RasterBits + j * SavedWidth, 
+				    sp->RasterBits + (size_t)j * SavedWidth, 
 				    SavedWidth)	== GIF_ERROR)
 			return (GIF_ERROR);
 		}
 	} else {
 	    for (j = 0; j < SavedHeight; j++) {
 		if (EGifPutLine(GifFileOut,
-				sp->RasterBits + j * SavedWidth,
+				sp->RasterBits + (size_t)j * SavedWidth,
 				SavedWidth) == GIF_ERROR)
 		    return (GIF_ERROR);
 	    }
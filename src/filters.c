@@ -1,4 +1,7 @@
 #include "filters.h"
+#include "blur_kernels.h"
+#include "mem_utils.h"
+#include "trace_utils.h"
 #include "utils.h"
 #include <math.h>
 #include <stdio.h>
@@ -6,7 +9,6 @@
 #include <string.h>
 
 void apply_gray_filter_once(img *image) {
-  int j;
   pixel *p;
   int width, height;
 
@@ -14,7 +16,7 @@ void apply_gray_filter_once(img *image) {
   width = image->width;
   height = image->height;
 
-  for (j = 0; j < width * height; j++) {
+  for (size_t j = 0; j < (size_t)width * height; j++) {
     int moy;
 
     moy = (p[j].r + p[j].g + p[j].b) / 3;
@@ -45,11 +47,12 @@ void apply_blur_filter_once(img *image, int size, int threshold) {
   height = image->height;
 
   /* Allocate array of new pixels */
-  new = (pixel *)malloc(width * height * sizeof(pixel));
+  new = (pixel *)malloc((size_t)width * height * sizeof(pixel));
 
   /* Perform at least one blur iteration */
 
   do {
+    double t = trace_now();
     end = 1;
     n_iter++;
 
@@ -136,6 +139,7 @@ void apply_blur_filter_once(img *image, int size, int threshold) {
       }
     }
 
+    trace_span("blur iteration", image->id, t);
   } while (threshold > 0 && !end);
 
 #if SOBELF_DEBUG
@@ -145,7 +149,7 @@ void apply_blur_filter_once(img *image, int size, int threshold) {
   free(new);
 }
 
-void apply_sobel_filter_once(img *image) {
+void apply_sobel_filter_once(img *image, int threshold) {
   int j, k;
   int width, height;
 
@@ -157,7 +161,7 @@ void apply_sobel_filter_once(img *image) {
 
   pixel *sobel;
 
-  sobel = (pixel *)malloc(width * height * sizeof(pixel));
+  sobel = (pixel *)malloc((size_t)width * height * sizeof(pixel));
 
   for (j = 1; j < height - 1; j++) {
     for (k = 1; k < width - 1; k++) {
@@ -187,7 +191,7 @@ void apply_sobel_filter_once(img *image) {
       val_blue =
           sqrt(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue) / 4;
 
-      if (val_blue > 50) {
+      if (val_blue > threshold) {
         sobel[CONV(j, k, width)].r = 255;
         sobel[CONV(j, k, width)].g = 255;
         sobel[CONV(j, k, width)].b = 255;
@@ -216,61 +220,29 @@ void apply_blur_filter_once_opt(img *image, const int size,
   int width = image->width;
   int height = image->height;
   pixel *p = image->p;
-  pixel *new = (pixel *)malloc(width * height * sizeof(pixel));
-  memcpy(new, p, width * height * sizeof(pixel));
+  pixel *new = mem_alloc((size_t)width * height * sizeof(pixel));
+  memcpy(new, p, (size_t)width * height * sizeof(pixel));
+
+  /* Stencil specialised for this radius */
+  const blur_kernel kernel = make_blur_kernel(size, threshold);
 
   do {
+    double t = trace_now();
     end = 1;
     n_iter++;
 
     /* Apply blur on top AND bottom part of image (10%) */
-#pragma GCC unroll 2
-    for (int j_idx = 0; j_idx < 2; j_idx++) {
-      for (int j = size; j < height / 10 - size; j++) {
-
-        int js[] = {j, height - j - 1};
-
-        for (int k = size; k < width - size; k++) {
-          int j_true = js[j_idx];
-
-          int t_r = 0;
-          int t_g = 0;
-          int t_b = 0;
-
-          for (int stencil_j = -size; stencil_j <= size; stencil_j++) {
-            for (int stencil_k = -size; stencil_k <= size; stencil_k++) {
-              t_r += p[CONV(j_true + stencil_j, k + stencil_k, width)].r;
-              t_g += p[CONV(j_true + stencil_j, k + stencil_k, width)].g;
-              t_b += p[CONV(j_true + stencil_j, k + stencil_k, width)].b;
-            }
-          }
-
-          new[CONV(j_true, k, width)].r =
-              t_r / ((2 * size + 1) * (2 * size + 1));
-          new[CONV(j_true, k, width)].g =
-              t_g / ((2 * size + 1) * (2 * size + 1));
-          new[CONV(j_true, k, width)].b =
-              t_b / ((2 * size + 1) * (2 * size + 1));
-
-          // calculate diffs direclty
-          float diff_r =
-              (new[CONV(j_true, k, width)].r - p[CONV(j_true, k, width)].r);
-          float diff_g =
-              (new[CONV(j_true, k, width)].g - p[CONV(j_true, k, width)].g);
-          float diff_b =
-              (new[CONV(j_true, k, width)].b - p[CONV(j_true, k, width)].b);
-
-          if (diff_r > threshold || -diff_r > threshold || diff_g > threshold ||
-              -diff_g > threshold || diff_b > threshold ||
-              -diff_b > threshold) {
-            end = 0;
-          }
-        }
-      }
+    for (int j = size; j < height / 10 - size; j++) {
+      if (kernel.row(&kernel, p, new, j, width))
+        end = 0;
+      if (kernel.row(&kernel, p, new, height - j - 1, width))
+        end = 0;
     }
+
     pixel *tmp = p;
     p = new;
     new = tmp;
+    trace_span("blur iteration", image->id, t);
   } while (threshold > 0 && !end);
 
 #if SOBELF_DEBUG
@@ -281,8 +253,8 @@ void apply_blur_filter_once_opt(img *image, const int size,
   image->p = p;
 }
 
-void apply_sobel_filter_once_opt(img *image) {
-  int j, k;
+void apply_sobel_filter_once_opt(img *image, int threshold) {
+  int j;
   int width, height;
 
   pixel *p;
@@ -293,48 +265,12 @@ void apply_sobel_filter_once_opt(img *image) {
 
   pixel *sobel;
 
-  sobel = (pixel *)malloc(width * height * sizeof(pixel));
-  memcpy(sobel, p,width * height * sizeof(pixel));
-
-  for (j = 1; j < height - 1; j++) {
-    for (k = 1; k < width - 1; k++) {
-      int pixel_blue_no, pixel_blue_n, pixel_blue_ne;
-      int pixel_blue_so, pixel_blue_s, pixel_blue_se;
-      int pixel_blue_o, pixel_blue_e;
-
-      float deltaX_blue;
-      float deltaY_blue;
-      float val_blue;
-
-      pixel_blue_no = p[CONV(j - 1, k - 1, width)].b;
-      pixel_blue_n = p[CONV(j - 1, k, width)].b;
-      pixel_blue_ne = p[CONV(j - 1, k + 1, width)].b;
-      pixel_blue_so = p[CONV(j + 1, k - 1, width)].b;
-      pixel_blue_s = p[CONV(j + 1, k, width)].b;
-      pixel_blue_se = p[CONV(j + 1, k + 1, width)].b;
-      pixel_blue_o = p[CONV(j, k - 1, width)].b;
-      pixel_blue_e = p[CONV(j, k + 1, width)].b;
-
-      deltaX_blue = -pixel_blue_no + pixel_blue_ne - 2 * pixel_blue_o +
-                    2 * pixel_blue_e - pixel_blue_so + pixel_blue_se;
-
-      deltaY_blue = pixel_blue_se + 2 * pixel_blue_s + pixel_blue_so -
-                    pixel_blue_ne - 2 * pixel_blue_n - pixel_blue_no;
-
-      val_blue =
-          sqrt(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue) / 4;
+  sobel = mem_alloc((size_t)width * height * sizeof(pixel));
+  memcpy(sobel, p, (size_t)width * height * sizeof(pixel));
 
-      if (val_blue > 50) {
-        sobel[CONV(j, k, width)].r = 255;
-        sobel[CONV(j, k, width)].g = 255;
-        sobel[CONV(j, k, width)].b = 255;
-      } else {
-        sobel[CONV(j, k, width)].r = 0;
-        sobel[CONV(j, k, width)].g = 0;
-        sobel[CONV(j, k, width)].b = 0;
-      }
-    }
-  }
+  const int limit = sobel_limit(threshold);
+  for (j = 1; j < height - 1; j++)
+    sobel_row(p, sobel, j, width, limit);
 
   free(p);
   image->p = sobel;
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif_frames.h"
+#include "perf_utils.h"
+#include "trace_utils.h"
+
+/* Rows of an interlaced frame come in 4 passes */
+static const int interlaced_offset[] = {0, 4, 2, 1};
+static const int interlaced_jumps[] = {8, 8, 4, 2};
+
+/*
+ * DGifSlurp without decoding: the LZW blocks of each frame are skipped and
+ * the offset of its descriptor is kept instead.
+ * */
+static int index_frames(GifFileType *g, gif_frames *frames,
+                        int alloc_raster) {
+  int capacity = 0;
+  GifRecordType type;
+
+  g->ExtensionBlocks = NULL;
+  g->ExtensionBlockCount = 0;
+
+  do {
+    if (DGifGetRecordType(g, &type) == GIF_ERROR)
+      return 0;
+
+    if (type == IMAGE_DESC_RECORD_TYPE) {
+      size_t offset = frames->mem.pos;
+      GifByteType *block;
+      int code_size;
+
+      if (DGifGetImageDesc(g) == GIF_ERROR)
+        return 0;
+
+      if (g->ImageCount > capacity) {
+        size_t *o;
+        unsigned char *l;
+        capacity = capacity ? 2 * capacity : 16;
+        o = realloc(frames->offset, capacity * sizeof(size_t));
+        if (o == NULL)
+          return 0;
+        frames->offset = o;
+        l = realloc(frames->interlace, capacity);
+        if (l == NULL)
+          return 0;
+        frames->interlace = l;
+      }
+      frames->offset[g->ImageCount - 1] = offset;
+      frames->interlace[g->ImageCount - 1] = g->Image.Interlace;
+
+      SavedImage *sp = &g->SavedImages[g->ImageCount - 1];
+      if (alloc_raster) {
+        sp->RasterBits = malloc((size_t)sp->ImageDesc.Width *
+                                sp->ImageDesc.Height * sizeof(GifPixelType));
+        if (sp->RasterBits == NULL)
+          return 0;
+      }
+
+      /* Skip the compressed data of the frame */
+      if (DGifGetCode(g, &code_size, &block) == GIF_ERROR)
+        return 0;
+      while (block != NULL)
+        if (DGifGetCodeNext(g, &block) == GIF_ERROR)
+          return 0;
+
+      if (g->ExtensionBlocks) {
+        sp->ExtensionBlocks = g->ExtensionBlocks;
+        sp->ExtensionBlockCount = g->ExtensionBlockCount;
+        g->ExtensionBlocks = NULL;
+        g->ExtensionBlockCount = 0;
+      }
+    } else if (type == EXTENSION_RECORD_TYPE) {
+      GifByteType *data;
+      int function;
+
+      if (DGifGetExtension(g, &function, &data) == GIF_ERROR)
+        return 0;
+      if (data != NULL &&
+          GifAddExtensionBlock(&g->ExtensionBlockCount, &g->ExtensionBlocks,
+                               function, data[0], &data[1]) == GIF_ERROR)
+        return 0;
+      while (data != NULL) {
+        if (DGifGetExtensionNext(g, &data) == GIF_ERROR)
+          return 0;
+        if (data != NULL &&
+            GifAddExtensionBlock(&g->ExtensionBlockCount,
+                                 &g->ExtensionBlocks, CONTINUE_EXT_FUNC_CODE,
+                                 data[0], &data[1]) == GIF_ERROR)
+          return 0;
+      }
+    }
+  } while (type != TERMINATE_RECORD_TYPE);
+
+  if (g->ImageCount == 0) {
+    g->Error = D_GIF_ERR_NO_IMAG_DSCR;
+    return 0;
+  }
+  return 1;
+}
+
+animated_gif *gif_frames_load(gif_frames *frames, const void *data,
+                              size_t size, pixel_alloc alloc,
+                              void *alloc_arg) {
+  animated_gif *image;
+  GifFileType *g;
+  int error;
+
+  frames->data = data;
+  frames->size = size;
+  frames->n_images = 0;
+  frames->offset = NULL;
+  frames->interlace = NULL;
+  frames->encoded = NULL;
+  frames->encoded_size = NULL;
+
+  g = gif_mem_open_read(&frames->mem, data, size, &error);
+  if (g == NULL) {
+    fprintf(stderr, "Error DGifOpen: %d <%s>\n", error,
+            GifErrorString(error));
+    return NULL;
+  }
+
+  if (!index_frames(g, frames, alloc != NULL)) {
+    fprintf(stderr, "Error indexing the frames: %d <%s>\n", g->Error,
+            GifErrorString(g->Error));
+    DGifCloseFile(g, NULL);
+    return NULL;
+  }
+  frames->n_images = g->ImageCount;
+  frames->encoded = calloc(frames->n_images, sizeof(unsigned char *));
+  frames->encoded_size = calloc(frames->n_images, sizeof(size_t));
+  if (frames->encoded == NULL || frames->encoded_size == NULL) {
+    fprintf(stderr, "Unable to allocate the output of %d images\n",
+            frames->n_images);
+    DGifCloseFile(g, NULL);
+    return NULL;
+  }
+
+  if (g->SColorMap == NULL) {
+    fprintf(stderr, "Error global colormap is NULL\n");
+    DGifCloseFile(g, NULL);
+    return NULL;
+  }
+  for (int i = 0; i < g->ImageCount; i++) {
+    if (g->SavedImages[i].ImageDesc.ColorMap) {
+      fprintf(stderr, "Error: application does not support local colormap\n");
+      DGifCloseFile(g, NULL);
+      return NULL;
+    }
+  }
+
+  image = malloc(sizeof(animated_gif));
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate memory for animated_gif\n");
+    DGifCloseFile(g, NULL);
+    return NULL;
+  }
+  image->n_images = g->ImageCount;
+  image->width = malloc(image->n_images * sizeof(int));
+  image->height = malloc(image->n_images * sizeof(int));
+  image->p = calloc(image->n_images, sizeof(pixel *));
+  image->g = g;
+  if (image->width == NULL || image->height == NULL || image->p == NULL) {
+    fprintf(stderr, "Unable to allocate the frames of %d images\n",
+            image->n_images);
+    free_pixels(image);
+    return NULL;
+  }
+
+  for (int i = 0; i < image->n_images; i++) {
+    image->width[i] = g->SavedImages[i].ImageDesc.Width;
+    image->height[i] = g->SavedImages[i].ImageDesc.Height;
+    if (alloc == NULL)
+      continue;
+    image->p[i] = alloc((size_t)image->width[i] * image->height[i],
+                        alloc_arg);
+    if (image->p[i] == NULL) {
+      fprintf(stderr, "Unable to allocate %d-th array of %zu pixels\n", i,
+              (size_t)image->width[i] * image->height[i]);
+      free_pixels(image);
+      return NULL;
+    }
+  }
+  return image;
+}
+
+int gif_frames_decode(const gif_frames *frames, int i, pixel *p) {
+  GifPixelType *raster = NULL;
+  gif_membuf mem;
+  GifFileType *g;
+  int error, ok = 0;
+  double t = trace_now();
+
+  /* A reader of our own, so that threads decode concurrently */
+  g = gif_mem_open_read(&mem, frames->data, frames->size, &error);
+  if (g == NULL) {
+    fprintf(stderr, "Error DGifOpen: %d <%s>\n", error,
+            GifErrorString(error));
+    return 0;
+  }
+  mem.pos = frames->offset[i];
+
+  if (DGifGetImageDesc(g) == GIF_OK) {
+    int width = g->Image.Width;
+    int height = g->Image.Height;
+
+    raster = malloc((size_t)width * height * sizeof(GifPixelType));
+    ok = raster != NULL;
+    if (ok && g->Image.Interlace) {
+      for (int pass = 0; pass < 4 && ok; pass++)
+        for (int j = interlaced_offset[pass]; j < height && ok;
+             j += interlaced_jumps[pass])
+          ok = DGifGetLine(g, raster + (size_t)j * width, width) == GIF_OK;
+    } else {
+      /* Row by row, as the line length is an int */
+      for (int j = 0; j < height && ok; j++)
+        ok = DGifGetLine(g, raster + (size_t)j * width, width) == GIF_OK;
+    }
+
+    if (ok) {
+      const GifColorType *colors = g->SColorMap->Colors;
+      for (long j = 0; j < (long)width * height; j++) {
+        p[j].r = colors[raster[j]].Red;
+        p[j].g = colors[raster[j]].Green;
+        p[j].b = colors[raster[j]].Blue;
+      }
+    }
+  }
+
+  if (!ok)
+    fprintf(stderr, "Error decoding frame %d: %d <%s>\n", i, g->Error,
+            GifErrorString(g->Error));
+  free(raster);
+  DGifCloseFile(g, NULL);
+  trace_span("decode", i, t);
+  return ok;
+}
+
+static ColorMapObject *gray_map(void) {
+  ColorMapObject *map = GifMakeMapObject(256, NULL);
+
+  if (map != NULL)
+    for (int c = 0; c < 256; c++)
+      map->Colors[c].Red = map->Colors[c].Green = map->Colors[c].Blue = c;
+  return map;
+}
+
+/* Index of color c of map in the gray palette, as map_pixels computes it */
+static int gray_index(const ColorMapObject *map, int c) {
+  int moy = (map->Colors[c].Red + map->Colors[c].Green + map->Colors[c].Blue) /
+            3;
+  return moy < 0 ? 0 : moy > 255 ? 255 : moy;
+}
+
+unsigned char *gif_frames_encode(const pixel *p, int width, int height,
+                                 int interlace, size_t *size) {
+  size_t n = (size_t)width * height;
+  GifPixelType *raster = malloc(n ? n : 1);
+  ColorMapObject *map = gray_map();
+  unsigned char *out = NULL;
+  gif_membuf mem;
+  GifFileType *g;
+  size_t start;
+  int error, ok;
+  perf_sample s;
+
+  perf_begin(&s);
+  g = gif_mem_open_write(&mem, &error);
+  if (g == NULL || raster == NULL || map == NULL) {
+    fprintf(stderr, "Unable to set up the encoding of a frame\n");
+    if (g != NULL)
+      EGifCloseFile(g, NULL);
+    free(mem.data);
+    free(raster);
+    GifFreeMapObject(map);
+    return NULL;
+  }
+
+  for (size_t j = 0; j < n; j++)
+    raster[j] = p[j].r < 0 ? 0 : p[j].r > 255 ? 255 : p[j].r;
+
+  ok = EGifPutScreenDesc(g, width, height, 8, 0, map) == GIF_OK &&
+       EGifPutImageDesc(g, 0, 0, width, height, interlace, NULL) == GIF_OK;
+  /* The image descriptor is followed by the code size byte */
+  start = mem.size;
+
+  if (ok && interlace) {
+    for (int pass = 0; pass < 4 && ok; pass++)
+      for (int j = interlaced_offset[pass]; j < height && ok;
+           j += interlaced_jumps[pass])
+        ok = EGifPutLine(g, raster + (size_t)j * width, width) == GIF_OK;
+  } else {
+    for (int j = 0; j < height && ok; j++)
+      ok = EGifPutLine(g, raster + (size_t)j * width, width) == GIF_OK;
+  }
+
+  /* Drop the empty block ending the frame */
+  if (ok && mem.size > start) {
+    *size = mem.size - start - 1;
+    out = malloc(*size ? *size : 1);
+    if (out != NULL)
+      memcpy(out, mem.data + start, *size);
+  }
+  if (out == NULL)
+    fprintf(stderr, "Error encoding a frame: %d <%s>\n", g->Error,
+            GifErrorString(g->Error));
+
+  EGifCloseFile(g, NULL);
+  free(mem.data);
+  free(raster);
+  GifFreeMapObject(map);
+  perf_end(&s, perf_lzw, n);
+  return out;
+}
+
+static int put_extensions(GifFileType *g2, const ExtensionBlock *blocks,
+                          int n_blocks) {
+  for (int j = 0; j < n_blocks; j++) {
+    const ExtensionBlock *ep = &blocks[j];
+
+    if (ep->Function != CONTINUE_EXT_FUNC_CODE &&
+        EGifPutExtensionLeader(g2, ep->Function) == GIF_ERROR)
+      return 0;
+    if (EGifPutExtensionBlock(g2, ep->ByteCount, ep->Bytes) == GIF_ERROR)
+      return 0;
+    if ((j == n_blocks - 1 || ep[1].Function != CONTINUE_EXT_FUNC_CODE) &&
+        EGifPutExtensionTrailer(g2) == GIF_ERROR)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Clear the transparency flag of the graphics control blocks. Every index
+ * of the gray palette is a level the filters may produce, so none can be
+ * transparent without hiding the pixels of its gray.
+ * */
+static void clear_transparency(ExtensionBlock *blocks, int n_blocks) {
+  for (int j = 0; j < n_blocks; j++)
+    if (blocks[j].Function == GRAPHICS_EXT_FUNC_CODE &&
+        blocks[j].ByteCount >= 4)
+      blocks[j].Bytes[0] &= ~0x01;
+}
+
+int gif_frames_write(const char *filename, GifFileType *g,
+                     const gif_frames *frames) {
+  ColorMapObject *map = gray_map();
+  GifFileType *g2;
+  gif_membuf mem;
+  size_t size_hint = 1 << 16;
+  int error, ok;
+
+  for (int i = 0; i < frames->n_images; i++)
+    size_hint += frames->encoded_size[i];
+
+  g2 = gif_mem_open_file(&mem, filename, size_hint, &error);
+  if (g2 == NULL || map == NULL) {
+    fprintf(stderr, "Error EGifOpenFileName %s\n", filename);
+    if (g2 != NULL) {
+      EGifCloseFile(g2, NULL);
+      gif_mem_close_file(&mem, filename);
+    }
+    GifFreeMapObject(map);
+    return 0;
+  }
+
+  clear_transparency(g->ExtensionBlocks, g->ExtensionBlockCount);
+  for (int i = 0; i < g->ImageCount; i++)
+    clear_transparency(g->SavedImages[i].ExtensionBlocks,
+                       g->SavedImages[i].ExtensionBlockCount);
+
+  /* The extensions decide between GIF87a and GIF89a */
+  g2->ImageCount = g->ImageCount;
+  g2->SavedImages = g->SavedImages;
+  g2->ExtensionBlockCount = g->ExtensionBlockCount;
+  g2->ExtensionBlocks = g->ExtensionBlocks;
+
+  ok = EGifPutScreenDesc(g2, g->SWidth, g->SHeight, g->SColorResolution,
+                         gray_index(g->SColorMap, g->SBackGroundColor),
+                         map) == GIF_OK;
+
+  for (int i = 0; ok && i < g->ImageCount; i++) {
+    const SavedImage *sp = &g->SavedImages[i];
+    const unsigned char *block = frames->encoded[i];
+    const unsigned char *end = block + frames->encoded_size[i];
+
+    ok = block != NULL && block < end &&
+         put_extensions(g2, sp->ExtensionBlocks, sp->ExtensionBlockCount) &&
+         EGifPutImageDesc(g2, sp->ImageDesc.Left, sp->ImageDesc.Top,
+                          sp->ImageDesc.Width, sp->ImageDesc.Height,
+                          sp->ImageDesc.Interlace, NULL) == GIF_OK;
+
+    /* The sub-blocks go out as they are, behind the code size byte */
+    for (block += 1; ok && block < end; block += block[-1] + 1)
+      ok = EGifPutCodeNext(g2, block - 1) == GIF_OK;
+    ok = ok && EGifPutCodeNext(g2, NULL) == GIF_OK;
+  }
+
+  ok = ok && put_extensions(g2, g->ExtensionBlocks, g->ExtensionBlockCount);
+  if (!ok)
+    fprintf(stderr, "Error writing %s: %d <%s>\n", filename, g2->Error,
+            GifErrorString(g2->Error));
+
+  g2->SavedImages = NULL;
+  g2->ExtensionBlocks = NULL;
+  EGifCloseFile(g2, NULL);
+  GifFreeMapObject(map);
+  return gif_mem_close_file(&mem, filename) && ok;
+}
+
+void gif_frames_free(gif_frames *frames) {
+  for (int i = 0; frames->encoded != NULL && i < frames->n_images; i++)
+    free(frames->encoded[i]);
+  free(frames->encoded);
+  free(frames->encoded_size);
+  free(frames->interlace);
+  free(frames->offset);
+  frames->encoded = NULL;
+  frames->encoded_size = NULL;
+  frames->interlace = NULL;
+  frames->offset = NULL;
+  frames->n_images = 0;
+}
+
+unsigned char *gif_frames_read_file(const char *filename, size_t *size) {
+  unsigned char *data;
+  FILE *f = fopen(filename, "rb");
+  long n;
+
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return NULL;
+  }
+  if (fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Unable to get the size of %s\n", filename);
+    fclose(f);
+    return NULL;
+  }
+
+  data = malloc(n ? n : 1);
+  if (data == NULL || fread(data, 1, n, f) != (size_t)n) {
+    fprintf(stderr, "Unable to read %s\n", filename);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *size = n;
+  return data;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gif_mem.h"
+
+/* Largest single write, as Linux transfers at most 2 GB at once */
+#define GIF_MEM_CHUNK ((size_t)1 << 30)
+
+/* Grow the mapping of mem->fd to capacity bytes */
+static int gif_mem_remap(gif_membuf *mem, size_t capacity) {
+  void *data;
+
+  if (ftruncate(mem->fd, capacity) != 0)
+    return 0;
+  data = mem->data == NULL
+             ? mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    mem->fd, 0)
+             : mremap(mem->data, mem->capacity, capacity, MREMAP_MAYMOVE);
+  if (data == MAP_FAILED)
+    return 0;
+  mem->data = data;
+  mem->capacity = capacity;
+  return 1;
+}
+
+int gif_mem_read(GifFileType *g, GifByteType *buf, int len) {
+  gif_membuf *mem = g->UserData;
+
+  if ((size_t)len > mem->size - mem->pos)
+    len = mem->size - mem->pos;
+  memcpy(buf, mem->data + mem->pos, len);
+  mem->pos += len;
+  return len;
+}
+
+int gif_mem_write(GifFileType *g, const GifByteType *buf, int len) {
+  gif_membuf *mem = g->UserData;
+
+  if (mem->size + len > mem->capacity) {
+    size_t capacity = mem->capacity ? mem->capacity : 4096;
+    while (capacity < mem->size + len)
+      capacity *= 2;
+
+    if (mem->mapped)
+      return gif_mem_remap(mem, capacity) ? gif_mem_write(g, buf, len) : 0;
+
+    unsigned char *data = realloc(mem->data, capacity);
+    if (data == NULL)
+      return 0;
+    mem->data = data;
+    mem->capacity = capacity;
+  }
+
+  memcpy(mem->data + mem->size, buf, len);
+  mem->size += len;
+  return len;
+}
+
+/* Decode from data, which must outlive the returned GifFileType */
+GifFileType *gif_mem_open_read(gif_membuf *mem, const void *data,
+                               size_t size, int *error) {
+  mem->data = (unsigned char *)data;
+  mem->size = size;
+  mem->pos = 0;
+  mem->capacity = 0;
+  mem->fd = -1;
+  mem->mapped = 0;
+  return DGifOpen(mem, gif_mem_read, error);
+}
+
+/* Encode into mem->data, to be released with free once done */
+GifFileType *gif_mem_open_write(gif_membuf *mem, int *error) {
+  mem->data = NULL;
+  mem->size = 0;
+  mem->pos = 0;
+  mem->capacity = 0;
+  mem->fd = -1;
+  mem->mapped = 0;
+  return EGifOpen(mem, gif_mem_write, error);
+}
+
+/* Create filename and encode for it, into a mapping of it when mapped */
+static GifFileType *gif_mem_create(gif_membuf *mem, const char *filename,
+                                   size_t size_hint, int mapped, int *error) {
+  GifFileType *g;
+  int fd;
+
+  // created first, so that a bad path fails before encoding
+  fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    *error = E_GIF_ERR_OPEN_FAILED;
+    return NULL;
+  }
+
+  g = gif_mem_open_write(mem, error);
+  if (g == NULL) {
+    close(fd);
+    return NULL;
+  }
+  mem->fd = fd;
+  mem->mapped = mapped;
+  if (mem->mapped && !gif_mem_remap(mem, size_hint < 4096 ? 4096 : size_hint))
+    mem->mapped = 0; /* falls back to memory */
+  return g;
+}
+
+GifFileType *gif_mem_open_file(gif_membuf *mem, const char *filename,
+                               size_t size_hint, int *error) {
+  const char *output = getenv("SOBELF_OUTPUT");
+
+  return gif_mem_create(mem, filename, size_hint,
+                        output != NULL && !strcmp(output, "mmap"), error);
+}
+
+GifFileType *gif_mem_open_mapped(gif_membuf *mem, const char *filename,
+                                 size_t size_hint, int *error) {
+  return gif_mem_create(mem, filename, size_hint, 1, error);
+}
+
+int gif_mem_close_file(gif_membuf *mem, const char *filename) {
+  int ok = 1;
+
+  if (mem->mapped) {
+    munmap(mem->data, mem->capacity);
+    ok = ftruncate(mem->fd, mem->size) == 0;
+  } else {
+    for (size_t done = 0; ok && done < mem->size;) {
+      size_t n = mem->size - done < GIF_MEM_CHUNK ? mem->size - done
+                                                  : GIF_MEM_CHUNK;
+      ssize_t written = write(mem->fd, mem->data + done, n);
+
+      if (written > 0)
+        done += written;
+      else if (written == 0 || errno != EINTR)
+        ok = 0;
+      if (written == 0)
+        errno = EIO;
+    }
+    free(mem->data);
+  }
+
+  if (close(mem->fd) != 0)
+    ok = 0;
+  if (!ok)
+    fprintf(stderr, "Error while writing %s: %s\n", filename,
+            strerror(errno));
+  mem->data = NULL;
+  mem->fd = -1;
+  mem->mapped = 0;
+  return ok;
+}
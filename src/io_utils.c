@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "io_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define IO_ENTRIES 32
+#define IO_THREADS 2
+/* Largest transfer of a single operation, bigger files take several */
+#define IO_CHUNK ((size_t)1 << 30)
+/* Writes in flight before io_write waits, bounding the buffers held */
+#define IO_MAX_WRITES 8
+
+struct io_file {
+  int fd;
+  int writing;
+  unsigned char *data;
+  size_t size;
+  size_t done;  /* bytes transferred so far */
+  int error;    /* errno of the failed transfer, 0 if none */
+  int finished;
+  char *path;   /* writes only, for the error message */
+  struct iovec iov; /* of the operation in flight on io_uring */
+  struct io_file *next; /* in the queue of the pool */
+};
+
+struct io_queue {
+  int ring; /* io_uring descriptor, -1 on the thread pool */
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  unsigned entries;
+  unsigned in_flight; /* operations submitted and not reaped */
+
+  pthread_t threads[IO_THREADS];
+  int n_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  io_file *head, *tail; /* transfers waiting for a thread */
+  int stop;
+
+  int n_writes; /* not finished yet */
+  int failed;
+};
+
+static void ring_reap(io_queue *q, int wait);
+
+static size_t chunk(const io_file *f) {
+  size_t n = f->size - f->done;
+  return n < IO_CHUNK ? n : IO_CHUNK;
+}
+
+/* Called once the last byte of f moved or it failed, under the pool lock */
+static void finish(io_queue *q, io_file *f) {
+  f->finished = 1;
+  if (!f->writing)
+    return;
+
+  if (close(f->fd) != 0 && !f->error)
+    f->error = errno;
+  if (f->error) {
+    fprintf(stderr, "Error while writing %s: %s\n", f->path,
+            strerror(f->error));
+    q->failed++;
+  }
+  q->n_writes--;
+  free(f->data);
+  free(f->path);
+  free(f);
+}
+
+static int ring_open(io_queue *q) {
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  q->ring = syscall(SYS_io_uring_setup, IO_ENTRIES, &p);
+  if (q->ring < 0)
+    return 0;
+
+  q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_ring_size > q->sq_ring_size)
+      q->sq_ring_size = q->cq_ring_size;
+    q->cq_ring_size = 0;
+  }
+  q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQ_RING);
+  q->cq_ring = q->cq_ring_size == 0
+                   ? q->sq_ring
+                   : mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, q->ring,
+                          IORING_OFF_CQ_RING);
+  q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQES);
+  if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED ||
+      q->sqes == MAP_FAILED) {
+    if (q->sq_ring != MAP_FAILED)
+      munmap(q->sq_ring, q->sq_ring_size);
+    if (q->cq_ring_size != 0 && q->cq_ring != MAP_FAILED)
+      munmap(q->cq_ring, q->cq_ring_size);
+    if (q->sqes != MAP_FAILED)
+      munmap(q->sqes, q->sqes_size);
+    close(q->ring);
+    q->ring = -1;
+    return 0;
+  }
+
+  sq = q->sq_ring;
+  cq = q->cq_ring;
+  q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  q->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *)(sq + p.sq_off.array);
+  q->cq_head = (unsigned *)(cq + p.cq_off.head);
+  q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  q->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  q->entries = p.sq_entries;
+  return 1;
+}
+
+/* Submit the next chunk of f */
+static void ring_submit(io_queue *q, io_file *f) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  // the completion ring is twice as large, it cannot overflow
+  while (q->in_flight >= q->entries)
+    ring_reap(q, 1);
+
+  tail = *q->sq_tail;
+  index = tail & *q->sq_mask;
+  sqe = &q->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  // the vectored operations are the ones every io_uring kernel has
+  f->iov.iov_base = f->data + f->done;
+  f->iov.iov_len = chunk(f);
+  sqe->opcode = f->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = f->fd;
+  sqe->addr = (uintptr_t)&f->iov;
+  sqe->len = 1;
+  sqe->off = f->done;
+  sqe->user_data = (uintptr_t)f;
+  q->sq_array[index] = index;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (syscall(SYS_io_uring_enter, q->ring, 1, 0, 0, NULL, 0) < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      continue;
+    // the entry stays in the ring, the kernel will still complete it
+    break;
+  }
+  q->in_flight++;
+}
+
+/* Handle the completions, after waiting for one if wait */
+static void ring_reap(io_queue *q, int wait) {
+  unsigned head = *q->cq_head;
+
+  if (wait && head == __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE))
+    while (syscall(SYS_io_uring_enter, q->ring, 0, 1, IORING_ENTER_GETEVENTS,
+                   NULL, 0) < 0 &&
+           errno == EINTR)
+      ;
+
+  while (head != __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+    io_file *f = (io_file *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+
+    __atomic_store_n(q->cq_head, ++head, __ATOMIC_RELEASE);
+    q->in_flight--;
+
+    if (res > 0)
+      f->done += res;
+    else if (res == 0)
+      f->error = EIO; /* the file was truncated meanwhile */
+    else if (res != -EINTR && res != -EAGAIN)
+      f->error = -res;
+
+    if (!f->error && f->done < f->size)
+      ring_submit(q, f);
+    else
+      finish(q, f);
+  }
+}
+
+/* Blocking transfer of f, on a thread of the pool */
+static void transfer(io_file *f) {
+  while (f->done < f->size && !f->error) {
+    ssize_t n = f->writing ? pwrite(f->fd, f->data + f->done, chunk(f),
+                                    f->done)
+                           : pread(f->fd, f->data + f->done, chunk(f),
+                                   f->done);
+    if (n > 0)
+      f->done += n;
+    else if (n == 0)
+      f->error = EIO;
+    else if (errno != EINTR)
+      f->error = errno;
+  }
+}
+
+static void *pool_thread(void *arg) {
+  io_queue *q = arg;
+
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->head == NULL && !q->stop)
+      pthread_cond_wait(&q->work, &q->lock);
+    if (q->head == NULL)
+      break;
+
+    io_file *f = q->head;
+    q->head = f->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    transfer(f);
+
+    pthread_mutex_lock(&q->lock);
+    finish(q, f);
+    pthread_cond_broadcast(&q->done);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+static int pool_open(io_queue *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work, NULL);
+  pthread_cond_init(&q->done, NULL);
+  for (; q->n_threads < IO_THREADS; q->n_threads++)
+    if (pthread_create(&q->threads[q->n_threads], NULL, pool_thread, q) != 0)
+      break;
+  return q->n_threads > 0;
+}
+
+io_queue *io_open(void) {
+  const char *backend = getenv("SOBELF_IO");
+  io_queue *q = calloc(1, sizeof(io_queue));
+
+  if (q == NULL)
+    return NULL;
+  q->ring = -1;
+  if (backend != NULL && !strcmp(backend, "threads"))
+    ;
+  else if (ring_open(q))
+    return q;
+
+  if (!pool_open(q)) {
+    fprintf(stderr, "Unable to start the I/O threads\n");
+    free(q);
+    return NULL;
+  }
+  return q;
+}
+
+const char *io_backend(const io_queue *q) {
+  return q->ring >= 0 ? "io_uring" : "threads";
+}
+
+static void start(io_queue *q, io_file *f) {
+  if (q->ring >= 0) {
+    if (f->size == 0)
+      finish(q, f);
+    else
+      ring_submit(q, f);
+    return;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == NULL)
+    q->head = f;
+  else
+    q->tail->next = f;
+  q->tail = f;
+  pthread_cond_signal(&q->work);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void wait_file(io_queue *q, io_file *f) {
+  if (q->ring >= 0) {
+    while (!f->finished)
+      ring_reap(q, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (!f->finished)
+    pthread_cond_wait(&q->done, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Wait until at most n writes are in flight, n_writes being updated */
+static void wait_writes(io_queue *q, int n) {
+  if (q->ring >= 0) {
+    while (q->n_writes > n)
+      ring_reap(q, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (q->n_writes > n)
+    pthread_cond_wait(&q->done, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+}
+
+io_file *io_read(io_queue *q, const char *path) {
+  io_file *f = calloc(1, sizeof(io_file));
+  struct stat st;
+
+  if (f == NULL)
+    return NULL;
+  f->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+    if (f->fd >= 0)
+      close(f->fd);
+    free(f);
+    return NULL;
+  }
+
+  f->size = st.st_size;
+  f->data = malloc(f->size ? f->size : 1);
+  if (f->data == NULL) {
+    fprintf(stderr, "Unable to allocate %zu bytes for %s\n", f->size, path);
+    close(f->fd);
+    free(f);
+    return NULL;
+  }
+  start(q, f);
+  return f;
+}
+
+unsigned char *io_read_wait(io_queue *q, io_file *f, size_t *size) {
+  unsigned char *data = f->data;
+
+  wait_file(q, f);
+  close(f->fd);
+  if (f->error) {
+    fprintf(stderr, "Error while reading: %s\n", strerror(f->error));
+    free(data);
+    data = NULL;
+  }
+  *size = f->size;
+  free(f);
+  return data;
+}
+
+int io_write(io_queue *q, const char *path, unsigned char *data,
+             size_t size) {
+  io_file *f = calloc(1, sizeof(io_file));
+
+  if (f == NULL || (f->path = strdup(path)) == NULL) {
+    free(f);
+    free(data);
+    return 0;
+  }
+  f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (f->fd < 0) {
+    fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+    free(f->path);
+    free(f);
+    free(data);
+    return 0;
+  }
+  f->writing = 1;
+  f->data = data;
+  f->size = size;
+
+  wait_writes(q, IO_MAX_WRITES - 1);
+  if (q->ring < 0)
+    pthread_mutex_lock(&q->lock);
+  q->n_writes++;
+  if (q->ring < 0)
+    pthread_mutex_unlock(&q->lock);
+  start(q, f);
+  return 1;
+}
+
+int io_close(io_queue *q) {
+  int ok;
+
+  wait_writes(q, 0);
+  ok = q->failed == 0;
+
+  if (q->ring >= 0) {
+    munmap(q->sqes, q->sqes_size);
+    if (q->cq_ring_size != 0)
+      munmap(q->cq_ring, q->cq_ring_size);
+    munmap(q->sq_ring, q->sq_ring_size);
+    close(q->ring);
+  } else {
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->n_threads; i++)
+      pthread_join(q->threads[i], NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+  }
+  free(q);
+  return ok;
+}
@@ -5,26 +5,34 @@
  */
 /* Set this macro to 1 to enable debugging information */
 #include <mpi.h>
+#include <getopt.h>
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 
-#include "cuda_filters.h"
+#include "backends.h"
+#include "batch_utils.h"
+#include "daemon_utils.h"
 #include "filters.h"
+#include "gif_frames.h"
+#include "mem_utils.h"
 #include "utils.h"
 
 #include "mpi_utils.h"
 #include "omp_utils.h"
+#include "perf_utils.h"
+#include "pipes.h"
+#include "rma_utils.h"
+#include "scatter_utils.h"
+#include "simd_filters.h"
+#include "strip_utils.h"
+#include "trace_utils.h"
+#include "tune_utils.h"
 
 #define SOBELF_DEBUG 0
 #define ROOT 0
-#define NPIXELS_THRESHOLD 1000000
-
-enum producer { prod_invalid, prod_def, prod_mpi, prod_omp };
-
-enum processor { proc_invalid, proc_def, proc_opt, proc_omp, proc_cuda };
 
 char *get_prod_name(enum producer p) {
   switch (p) {
@@ -34,24 +42,18 @@ char *get_prod_name(enum producer p) {
     return "OMP";
   case prod_mpi:
     return "MPI";
+  case prod_rma:
+    return "MPI RMA";
+  case prod_static:
+    return "MPI static";
   default:
     return "";
   }
 }
 
-char *get_proc_name(enum processor p) {
-  switch (p) {
-  case proc_def:
-    return "default";
-  case proc_omp:
-    return "OMP";
-  case proc_cuda:
-    return "CUDA";
-  case proc_opt:
-    return "optimized default";
-  default:
-    return "";
-  }
+const char *get_proc_name(enum processor p) {
+  const backend *b = backend_get(p);
+  return b != NULL ? b->label : "";
 }
 
 enum producer parse_producer(char *str) {
@@ -61,102 +63,431 @@ enum producer parse_producer(char *str) {
     return prod_def;
   else if (!strcmp(str, "mpi"))
     return prod_mpi;
+  else if (!strcmp(str, "mpi-rma"))
+    return prod_rma;
+  else if (!strcmp(str, "mpi-static"))
+    return prod_static;
   else if (!strcmp(str, "omp"))
     return prod_omp;
   else
     return prod_invalid;
 }
 
+/* Producers spreading the frames of one file over the MPI ranks */
+int is_mpi_producer(enum producer p) {
+  return p == prod_mpi || p == prod_rma || p == prod_static;
+}
+
 enum processor parse_processor(char *str) {
+  const backend *b;
+
   if (str == NULL)
     return proc_def;
-  else if (!strcmp(str, "default"))
-    return proc_def;
-  else if (!strcmp(str, "opt"))
-    return proc_opt;
-  else if (!strcmp(str, "omp"))
-    return proc_omp;
-  else if (!strcmp(str, "cuda"))
-    return proc_cuda;
-  else
-    return proc_invalid;
+  b = backend_find(str);
+  return b != NULL ? b->proc : proc_invalid;
 }
 
-void decide_parameters(img *images, enum processor *out_processor,
-                       enum producer *out_producer) {
-
-  int n_pixels = images[0].width * images[0].height;
-  int n_threads = omp_get_max_threads();
-  *out_producer = prod_def;
+/*
+ * Pick the configuration with the smallest time estimated by the cost model
+ * of this machine, n_workers ranks being available to the mpi producers
+ * that filter out_threads frames at once on each rank.
+ */
+void decide_parameters(img *images, int n_images, int n_workers,
+                       enum processor *out_processor,
+                       enum producer *out_producer, int *out_threads) {
+  double estimate = tune_decide(images, n_images, n_workers, out_producer,
+                                out_processor, out_threads);
 
-  if (is_cuda_available() && n_pixels > NPIXELS_THRESHOLD)
-    *out_processor = proc_cuda;
-  else if (n_threads > 1)
-    *out_processor = proc_omp;
-  else
-    *out_processor = proc_def;
+  printf("Estimated filter time %lf s\n", estimate);
 }
 
-void omp_pipe(img *image) {
-#if SOBELF_DEBUG
-  printf("Available threads in pipe: %d \n", omp_get_max_threads());
-#endif
+/*
+ * Collective: the root reads the file and broadcasts its bytes, then every
+ * rank indexes the frames without decoding them. Only the root gets frame
+ * buffers, the workers decode the frames they are sent.
+ */
+animated_gif *load_compressed(char *filename, int rank, unsigned char **data,
+                              gif_frames *frames) {
+  /* MPI counts are ints, broadcast large files in chunks */
+  const long chunk = 1L << 30;
+  size_t n = 0;
+  long size = -1;
+
+  double t = trace_now();
+
+  if (rank == ROOT) {
+    *data = gif_frames_read_file(filename, &n);
+    if (*data != NULL)
+      size = n;
+  }
+  MPI_Bcast(&size, 1, MPI_LONG, ROOT, MPI_COMM_WORLD);
+  if (size < 0)
+    return NULL;
+
+  if (rank != ROOT) {
+    *data = malloc(size ? size : 1);
+    if (*data == NULL) {
+      fprintf(stderr, "Unable to allocate %ld bytes for the GIF\n", size);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  for (long offset = 0; offset < size; offset += chunk)
+    MPI_Bcast(*data + offset, size - offset < chunk ? size - offset : chunk,
+              MPI_BYTE, ROOT, MPI_COMM_WORLD);
+  trace_span("broadcast", -1, t);
 
-  omp_apply_gray_filter(image);
+  return gif_frames_load(frames, *data, size,
+                         rank == ROOT ? mem_pixel_alloc : NULL, NULL);
+}
 
-  /* Apply blur filter with convergence value */
-  omp_apply_blur_filter(image, 5, 20);
+/*
+ * Collective: gather the trace events of every rank on the root, which
+ * writes them all to filename.
+ */
+void write_trace(const char *filename, int rank, int size, int use_mpi) {
+  size_t n = 0;
+  char *events = trace_json(rank, &n);
+  char *all = events;
+  int len = n, *lens = NULL, *displs = NULL;
+
+  if (use_mpi) {
+    if (rank == ROOT) {
+      lens = malloc(sizeof(int) * size);
+      displs = malloc(sizeof(int) * size);
+    }
+    MPI_Gather(&len, 1, MPI_INT, lens, 1, MPI_INT, ROOT, MPI_COMM_WORLD);
+    if (rank == ROOT) {
+      n = 0;
+      for (int i = 0; i < size; i++) {
+        displs[i] = n;
+        n += lens[i];
+      }
+      all = malloc(n ? n : 1);
+    }
+    MPI_Gatherv(events, len, MPI_CHAR, all, lens, displs, MPI_CHAR, ROOT,
+                MPI_COMM_WORLD);
+  }
 
-  /* Apply sobel filter on pixels */
-  omp_apply_sobel_filter(image);
+  if (rank == ROOT && all != NULL) {
+    if (trace_write(filename, all, n))
+      printf("Trace written to %s\n", filename);
+  }
+  if (all != events)
+    free(all);
+  free(events);
+  free(lens);
+  free(displs);
 }
 
-void opt_pipe(img *image) {
-  /* Convert the pixels into grayscale */
-  apply_gray_filter_once(image);
+/*
+ * Collective: add up the stage counters of every rank on the root, which
+ * prints them and appends them to the log after the timings of label.
+ */
+void report_counters(const char *log_filename, const char *label, int rank,
+                     int use_mpi) {
+  double totals[n_perf_stages * PERF_N_FIELDS];
+  double sums[n_perf_stages * PERF_N_FIELDS];
+  FILE *flog;
 
-  /* Apply blur filter with convergence value */
-  apply_blur_filter_once_opt(image, 5, 20);
+  perf_totals(totals);
+  if (use_mpi)
+    MPI_Reduce(totals, sums, n_perf_stages * PERF_N_FIELDS, MPI_DOUBLE,
+               MPI_SUM, ROOT, MPI_COMM_WORLD);
+  else
+    memcpy(sums, totals, sizeof(sums));
+  if (rank != ROOT)
+    return;
 
-  /* Apply sobel filter on pixels */
-  apply_sobel_filter_once_opt(image);
+  printf("Counters: input; stage; s; pixels; IPC; LLC misses per pixel; "
+         "GB/s per thread\n");
+  perf_report(stdout, label, sums);
+
+  flog = fopen(log_filename, "a");
+  if (flog == NULL) {
+    fprintf(stderr, "Could not open log file (%s)\n", log_filename);
+    return;
+  }
+  perf_report(flog, label, sums);
+  fclose(flog);
 }
 
-void default_pipe(img *image) {
-  /* Convert the pixels into grayscale */
-  apply_gray_filter_once(image);
+/* Decode every frame on the root, for the producers that do not ship them */
+int decode_frames(const gif_frames *frames, img *images, int n_images) {
+  int ok = 1;
 
-  /* Apply blur filter with convergence value */
-  apply_blur_filter_once(image, 5, 20);
+#pragma omp parallel for schedule(dynamic) reduction(&& : ok)
+  for (int i = 0; i < n_images; i++)
+    ok = gif_frames_decode(frames, i, images[i].p);
+  return ok;
+}
+
+/* NULL when the backend of proc cannot be loaded on this node */
+pipe_fn select_pipe(enum processor proc) { return backend_pipe(proc); }
+
+/* Configuration shared by every file of a batch */
+typedef struct {
+  enum producer prod;
+  enum processor proc;
+  int auto_config; /* decide producer and processor for each file */
+  filter_params params;
+  int frame_diff; /* write only the changed rectangle of each frame */
+} batch_config;
+
+/*
+ * Process one file of a batch entirely on the calling rank. The frames are
+ * filtered with the local producer (default or omp), the mpi producer being
+ * already used to spread the files over the ranks. The input comes from
+ * job->data when it was read ahead, and the output goes through job->io
+ * when the job has a queue.
+ */
+double process_file(batch_job *job, void *arg) {
+  batch_config *config = arg;
+  enum producer prod = config->prod;
+  enum processor proc = config->proc;
+  animated_gif *image;
+  gif_membuf input, output;
+  struct timeval t1, t2;
+  double duration;
+  int ok;
+
+  if (job->data != NULL)
+    image = load_pixels_mem(&input, job->data, job->data_size);
+  else
+    image = load_pixels(job->input);
+  if (image == NULL)
+    return -1;
 
-  /* Apply sobel filter on pixels */
-  apply_sobel_filter_once(image);
+  img *images = malloc(sizeof(img) * image->n_images);
+  for (int i = 0; i < image->n_images; i++) {
+    images[i].width = image->width[i];
+    images[i].height = image->height[i];
+    images[i].id = i;
+    images[i].p = image->p[i];
+  }
+
+  if (config->auto_config) {
+    int n_threads;
+    decide_parameters(images, image->n_images, 0, &proc, &prod, &n_threads);
+  }
+
+  pipe_fn pipe = select_pipe(proc);
+  if (pipe == NULL) {
+    free(images);
+    free_pixels(image);
+    return -1;
+  }
+
+  /* FILTER Timer start */
+  gettimeofday(&t1, NULL);
+
+  if (prod == prod_omp && proc != proc_omp)
+    omp_server(image->n_images, images, pipe, &config->params);
+  else
+    for (int i = 0; i < image->n_images; i++)
+      pipe(images + i, &config->params);
+
+  /* FILTER Timer stop */
+  gettimeofday(&t2, NULL);
+
+  duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
+
+  for (int i = 0; i < image->n_images; i++)
+    image->p[i] = images[i].p;
+  free(images);
+
+  if (job->io != NULL)
+    ok = store_pixels_mem(&output, image, config->frame_diff) &&
+         io_write(job->io, job->output, output.data, output.size);
+  else
+    ok = store_pixels(job->output, image, config->frame_diff);
+
+  if (!ok)
+    duration = -1;
+  else
+    printf("%s -> %s: %d image(s) filtered in %lf s\n", job->input,
+           job->output, image->n_images, duration);
+
+  free_pixels(image);
+  return duration;
 }
 
-void log_pipe(img *image) {
+/*
+ * Process a whole directory (or @list file) of GIFs within this MPI job.
+ * The ranks share a queue of files, largest first, held by the root.
+ */
+int run_batch(char *input, char *output_dir, char *log_filename,
+              batch_config *config, int mpi_rank, int mpi_n_workers) {
+  batch_job *jobs;
+  int n_jobs;
   struct timeval t1, t2;
   double duration;
+  FILE *flog;
+
+  jobs = batch_collect(input, output_dir, &n_jobs);
+  if (jobs == NULL)
+    return 0;
+
+  if (mpi_rank != ROOT) {
+    batch_worker(jobs, process_file, config);
+    batch_free(jobs, n_jobs);
+    return 1;
+  }
+
+  flog = fopen(log_filename, "a");
+  if (flog == NULL) {
+    fprintf(stderr, "Could not open log file (%s)\n", log_filename);
+    batch_free(jobs, n_jobs);
+    return 0;
+  }
+
+  printf("Batch of %d file(s) from %s on %d worker(s)\n", n_jobs, input,
+         mpi_n_workers);
 
   gettimeofday(&t1, NULL);
-  /* Convert the pixels into grayscale */
-  apply_gray_filter_once(image);
+  batch_server(mpi_n_workers, n_jobs, jobs, flog, process_file, config);
   gettimeofday(&t2, NULL);
+
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
-  printf("gray done in %lf\n", duration);
+  printf("BATCH done in %lf s\n", duration);
+
+  fclose(flog);
+  batch_free(jobs, n_jobs);
+  return 1;
+}
 
-  /* Apply blur filter with convergence value */
+/*
+ * Filter one file with the frames kept out of core, see strip_utils.h. The
+ * opt chain runs on the root alone, whatever the producer and processor.
+ */
+int run_out_of_core(char *input, char *output, char *log_filename,
+                    const filter_params *params) {
+  struct timeval t1, t2;
+  double duration;
+  strip_gif *s;
+  FILE *flog;
+  int ok;
+
+  flog = fopen(log_filename, "a");
+  if (flog == NULL) {
+    fprintf(stderr, "Could not open log file (%s)\n", log_filename);
+    return 0;
+  }
+
+  /* IMPORT Timer start */
   gettimeofday(&t1, NULL);
-  apply_blur_filter_once(image, 5, 20);
+  double t = trace_now();
+
+  s = strip_load(input);
+  if (s == NULL) {
+    fclose(flog);
+    return 0;
+  }
+
+  /* IMPORT Timer stop */
   gettimeofday(&t2, NULL);
+  trace_span("load", -1, t);
+
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
-  printf("blur done in %lf\n", duration);
+  printf("GIF loaded from file %s with %d image(s) in %lf s\n", input,
+         strip_n_images(s), duration);
 
-  /* Apply sobel filter on pixels */
+  printf("Running with configuration\n");
+  printf("\tProducer: %s\n", get_prod_name(prod_def));
+  printf("\tProcessor: %s (out of core)\n", get_proc_name(proc_opt));
+
+  /* FILTER Timer start */
   gettimeofday(&t1, NULL);
-  apply_sobel_filter_once(image);
+  t = trace_now();
+
+  ok = strip_filter(s, params);
+
+  /* FILTER Timer stop */
   gettimeofday(&t2, NULL);
+  trace_span("filter", -1, t);
+
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
-  printf("soble done in %lf\n", duration);
+
+  if (ok) {
+    printf("SOBEL done in %lf s\n", duration);
+    fprintf(flog, "%s; %lf\n", input, duration);
+
+    /* EXPORT Timer start */
+    gettimeofday(&t1, NULL);
+    t = trace_now();
+
+    ok = strip_store(output, s);
+
+    /* EXPORT Timer stop */
+    gettimeofday(&t2, NULL);
+    trace_span("export", -1, t);
+
+    duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
+    if (ok)
+      printf("Export done in %lf s in file %s\n", duration, output);
+  }
+
+  strip_free(s);
+  fclose(flog);
+  return ok;
+}
+
+/*
+ * Run one daemon request: "input.gif output.gif [producer processor]",
+ * falling back to the daemon configuration when no pair is given.
+ */
+double process_request(char *request, void *arg) {
+  batch_config config = *(batch_config *)arg;
+  char line[DAEMON_MAX_REQUEST];
+  batch_job job = {0};
+  char *prod_name, *proc_name;
+
+  snprintf(line, sizeof(line), "%s", request);
+  job.input = strtok(line, " \t");
+  job.output = strtok(NULL, " \t");
+  prod_name = strtok(NULL, " \t");
+  proc_name = strtok(NULL, " \t");
+
+  if (job.output == NULL)
+    return -1;
+
+  if (proc_name != NULL) {
+    config.prod = parse_producer(prod_name);
+    config.proc = parse_processor(proc_name);
+    config.auto_config = 0;
+    if (config.prod == prod_invalid || config.proc == proc_invalid)
+      return -1;
+  }
+
+  return process_file(&job, &config);
+}
+
+/*
+ * Keep the ranks initialised and serve jobs received on a UNIX socket
+ * until a client sends "quit".
+ */
+int run_daemon(char *socket_path, char *log_filename, batch_config *config,
+               int mpi_rank, int mpi_n_workers) {
+  FILE *flog;
+
+  /* Load the CUDA backend once so that no request pays for it */
+  if (config->auto_config || config->proc == proc_cuda)
+    backend_available(proc_cuda);
+
+  if (mpi_rank != ROOT) {
+    daemon_worker(process_request, config);
+    return 1;
+  }
+
+  flog = fopen(log_filename, "a");
+  if (flog == NULL) {
+    fprintf(stderr, "Could not open log file (%s)\n", log_filename);
+    return 0;
+  }
+
+  daemon_server(mpi_n_workers, socket_path, flog, process_request, config);
+
+  fclose(flog);
+  return 1;
 }
 
 /*
@@ -165,7 +496,7 @@ void log_pipe(img *image) {
 int main(int argc, char **argv) {
   char *input_filename;
   char *output_filename;
-  char *log_filename;
+  char *log_filename = NULL;
   enum producer prod;  /*default, mpi, omp*/
   enum processor proc; /*default, omp, cuda*/
   animated_gif *image;
@@ -173,42 +504,202 @@ int main(int argc, char **argv) {
   double duration;
   FILE *flog;
 
-  int mpi_rank, mpi_size;
+  int mpi_rank = ROOT, mpi_size = 1;
   int mpi_n_workers = 0;
-  int provided;
-
-  void (*pipe)(img *);
+  int use_mpi = 0;
+  int provided = MPI_THREAD_SINGLE;
+  int n_threads = 0; /* frame-processing threads of each rank, 0: default */
+  /* Workers either wait for a negative job or pull frames until stopped */
+  enum { workers_waiting, workers_pulling, workers_stopped } workers =
+      workers_waiting;
+
+  pipe_fn pipe;
+  filter_params params = FILTER_PARAMS_DEFAULT;
+
+  static struct option long_options[] = {
+      {"serve", required_argument, NULL, 's'},
+      {"blur-size", required_argument, NULL, 'r'},
+      {"blur-threshold", required_argument, NULL, 't'},
+      {"sobel-threshold", required_argument, NULL, 'e'},
+      {"affinity", no_argument, NULL, 'a'},
+      {"compressed", no_argument, NULL, 'z'},
+      {"trace", required_argument, NULL, 'T'},
+      {"counters", no_argument, NULL, 'c'},
+      {"frame-diff", no_argument, NULL, 'd'},
+      {"out-of-core", no_argument, NULL, 'o'},
+      {NULL, 0, NULL, 0}};
+  char *socket_path = NULL;
+  char *trace_filename = NULL;
+  int counters = 0;
+  char names[128];
+  int affinity = 0;
+  int compressed = 0;
+  int frame_diff = 0;
+  int out_of_core = 0;
+  unsigned char *gif_data = NULL;
+  gif_frames frames = {0};
+  shared_frames *shared = NULL; /* frames the mpi producer left in its window */
+  char **args = NULL;
+  int n_args;
+  int opt;
+
+  while ((opt = getopt_long(argc, argv, "s:r:t:e:azT:cdo", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'r':
+      params.blur_size = atoi(optarg);
+      break;
+    case 't':
+      params.blur_threshold = atoi(optarg);
+      break;
+    case 'e':
+      params.sobel_threshold = atoi(optarg);
+      break;
+    case 'a':
+      affinity = 1;
+      break;
+    case 'z':
+      compressed = 1;
+      break;
+    case 'T':
+      trace_filename = optarg;
+      break;
+    case 'c':
+      counters = 1;
+      break;
+    case 'd':
+      frame_diff = 1;
+      break;
+    case 'o':
+      out_of_core = 1;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  args = argv + optind;
+  n_args = argc - optind;
 
   /* Check command-line arguments */
-  if (argc != 4 && argc != 6) {
+  if (params.blur_size < 0 || (socket_path != NULL
+                                   ? (n_args != 1 && n_args != 3)
+                                   : (n_args != 3 && n_args != 5))) {
+  usage:
     fprintf(
         stderr,
-        "Usage: %s input.gif output.gif log_file.log [producer] [processor]\n",
-        argv[0]);
-    fprintf(stderr, "producer:  default | mpi | omp\n");
-    fprintf(stderr, "processor: default | omp\n");
+        "Usage: %s input.gif output.gif log_file.log [producer] [processor]\n"
+        "       %s input_dir|@list output_dir log_file.log [producer] "
+        "[processor]\n"
+        "       %s --serve socket log_file.log [producer] [processor]\n"
+        "options: --blur-size N (5) --blur-threshold N (20) "
+        "--sobel-threshold N (50) --affinity --compressed "
+        "--trace file.json --counters --frame-diff --out-of-core\n",
+        argv[0], argv[0], argv[0]);
+    fprintf(stderr, "producer:  default | mpi | mpi-rma | mpi-static | omp\n");
+    backend_names(names, sizeof(names));
+    fprintf(stderr, "processor: %s\n", names);
     goto kill;
   }
 
-  input_filename = argv[1];
-  output_filename = argv[2];
-  log_filename = argv[3];
-
-  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
-  MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  /* A single process has no one to talk to, save the MPI startup */
+  use_mpi = mpi_launched();
+  if (use_mpi) {
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+  }
   mpi_n_workers = mpi_size - 1;
 
+  /* Ranks start their clocks together, so that their timelines line up */
+  if (trace_filename != NULL) {
+    if (use_mpi)
+      MPI_Barrier(MPI_COMM_WORLD);
+    trace_start();
+  }
+  if (counters)
+    perf_start();
+  log_filename = args[socket_path != NULL ? 0 : 2];
+
+  /* Pin the OMP threads per socket, before any frame buffer is touched */
+  if (affinity) {
+    int node_rank = 0, node_size = 1;
+    char label[32];
+    if (use_mpi) {
+      MPI_Comm node;
+      MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mpi_rank,
+                          MPI_INFO_NULL, &node);
+      MPI_Comm_rank(node, &node_rank);
+      MPI_Comm_size(node, &node_size);
+      MPI_Comm_free(&node);
+    }
+    snprintf(label, sizeof(label), "rank %d", mpi_rank);
+    mem_pin_threads(label, node_rank, node_size);
+  }
+
+  /* The cost model drives the automatic configurations and proc auto */
+  if (!out_of_core && (n_args == (socket_path != NULL ? 1 : 3) ||
+                       !strcmp(args[n_args - 1], "auto")))
+    tune_init(mpi_rank, mpi_n_workers);
+
+  if (socket_path != NULL) {
+    batch_config config = {parse_producer(n_args == 3 ? args[1] : NULL),
+                           parse_processor(n_args == 3 ? args[2] : NULL),
+                           n_args == 1, params, frame_diff};
+
+    if (config.prod == prod_invalid || config.proc == proc_invalid) {
+      fprintf(stderr, "Invalid producer or processor parameter.\n");
+      goto kill;
+    }
+
+    run_daemon(socket_path, log_filename, &config, mpi_rank, mpi_n_workers);
+    goto kill;
+  }
+
+  input_filename = args[0];
+  output_filename = args[1];
+
+  if (is_batch_input(input_filename)) {
+    batch_config config = {parse_producer(n_args == 5 ? args[3] : NULL),
+                           parse_processor(n_args == 5 ? args[4] : NULL),
+                           n_args == 3, params, frame_diff};
+
+    if (config.prod == prod_invalid || config.proc == proc_invalid) {
+      fprintf(stderr, "Invalid producer or processor parameter.\n");
+      goto kill;
+    }
+
+    run_batch(input_filename, output_filename, log_filename, &config,
+              mpi_rank, mpi_n_workers);
+    goto kill;
+  }
+
+  /* The workers have nothing to do, nor to be told */
+  if (out_of_core) {
+    if (mpi_rank == ROOT)
+      run_out_of_core(input_filename, output_filename, log_filename,
+                      &params);
+    workers = workers_stopped;
+    goto kill;
+  }
+
   /* IMPORT Timer start */
   gettimeofday(&t1, NULL);
+  double t = trace_now();
 
-  /* Load file and store the pixels in array */
-  image = load_pixels(input_filename);
+  /* Load file and store the pixels in array, or only index it */
+  if (compressed && use_mpi)
+    image = load_compressed(input_filename, mpi_rank, &gif_data, &frames);
+  else
+    image = load_pixels(input_filename);
   if (image == NULL)
     goto kill;
 
   /* IMPORT Timer stop */
   gettimeofday(&t2, NULL);
+  trace_span("load", -1, t);
 
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
 
@@ -221,16 +712,17 @@ int main(int argc, char **argv) {
   for (int i = 0; i < image->n_images; i++) {
     images[i].width = image->width[i];
     images[i].height = image->height[i];
-    images[i].id = 1;
+    images[i].id = i;
     images[i].p = image->p[i];
   }
 
-  if (argc == 4) {
-    decide_parameters(images, &proc, &prod);
+  if (n_args == 3) {
+    decide_parameters(images, image->n_images, mpi_n_workers, &proc, &prod,
+                      &n_threads);
   }
-  if (argc == 6) {
-    prod = parse_producer(argv[4]);
-    proc = parse_processor(argv[5]);
+  if (n_args == 5) {
+    prod = parse_producer(args[3]);
+    proc = parse_processor(args[4]);
   }
 
   // print the current configuration
@@ -255,32 +747,45 @@ int main(int argc, char **argv) {
   }
 
   // Defining pipe depending on proceadure
-  switch (proc) {
-  case proc_omp:
-    pipe = omp_pipe;
-    break;
-  case proc_opt:
-    pipe = opt_pipe;
-    break;
-  case proc_cuda:
-    pipe = cuda_pipe;
-    break;
-  default:
-    pipe = default_pipe;
-    break;
-  }
+  pipe = select_pipe(proc);
+  if (pipe == NULL)
+    goto kill;
 
-  if (mpi_n_workers <= 0 && prod == prod_mpi) {
+  if (mpi_n_workers <= 0 && is_mpi_producer(prod)) {
     fprintf(stderr, "Invalid combination. Cannot have mpi producers with only "
                     "one available rank.\n");
     goto kill;
   }
 
+  /*
+   * Sequential processors run one frame per thread on each rank, the
+   * others get the whole rank for each frame, unless the cost model
+   * picked fewer frames at once.
+   */
+  if (n_threads == 0)
+    n_threads = backend_get(proc)->parallel ? 1 : omp_get_max_threads();
+  if (provided < MPI_THREAD_MULTIPLE)
+    n_threads = 1;
   if (mpi_rank != ROOT) {
-    mpi_worker(mpi_rank, pipe);
+    if (prod == prod_rma)
+      rma_filter(n_threads, image->n_images, images, ROOT, pipe, &params,
+                 gif_data ? &frames : NULL);
+    else if (prod == prod_static)
+      scatter_filter(n_threads, image->n_images, images, ROOT, pipe, &params,
+                     gif_data ? &frames : NULL);
+    else
+      mpi_worker(n_threads, pipe, &params, gif_data ? &frames : NULL);
+    gif_frames_free(&frames);
+    free(gif_data);
+    if (trace_filename != NULL)
+      write_trace(trace_filename, mpi_rank, mpi_size, use_mpi);
+    if (counters)
+      report_counters(log_filename, args[0], mpi_rank, use_mpi);
     MPI_Finalize();
     return 0;
   }
+  if (use_mpi)
+    workers = workers_pulling;
 
   /* Everything here on is for the ROOT to execute! */
   flog = fopen(log_filename, "a");
@@ -289,25 +794,46 @@ int main(int argc, char **argv) {
     goto kill;
   }
 
+  /* Only the mpi producers decode the frames where they are filtered */
+  if (gif_data != NULL && !is_mpi_producer(prod) &&
+      !decode_frames(&frames, images, image->n_images)) {
+    fclose(flog);
+    goto kill;
+  }
+
   /* FILTER Timer start */
   gettimeofday(&t1, NULL);
+  t = trace_now();
 
   // producing jobs according to preference
   switch (prod) {
   case prod_mpi:
-    mpi_server(mpi_n_workers, image->n_images, images, ROOT);
+    mpi_server(mpi_n_workers, image->n_images, images, ROOT, pipe, &params,
+               gif_data ? &frames : NULL, &shared);
+    workers = workers_stopped;
+    break;
+  case prod_rma:
+    rma_filter(n_threads, image->n_images, images, ROOT, pipe, &params,
+               gif_data ? &frames : NULL);
+    workers = workers_stopped;
+    break;
+  case prod_static:
+    scatter_filter(n_threads, image->n_images, images, ROOT, pipe, &params,
+                   gif_data ? &frames : NULL);
+    workers = workers_stopped;
     break;
   case prod_omp:
-    omp_server(image->n_images, images, pipe);
+    omp_server(image->n_images, images, pipe, &params);
     break;
   default:
     for (int i = 0; i < image->n_images; i++)
-      pipe(images + i);
+      pipe(images + i, &params);
     break;
   }
 
   /* FILTER Timer stop */
   gettimeofday(&t2, NULL);
+  trace_span("filter", -1, t);
 
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
 
@@ -320,14 +846,22 @@ int main(int argc, char **argv) {
 
   /* EXPORT Timer start */
   gettimeofday(&t1, NULL);
-
-  /* Store file from array of pixels to GIF file */
-  if (!store_pixels(output_filename, image)) {
-    return 1;
+  t = trace_now();
+
+  /*
+   * Store file from array of pixels to GIF file, or from the frames the
+   * mpi producer got back encoded
+   */
+  if (gif_data != NULL && prod == prod_mpi
+          ? !gif_frames_write(output_filename, image->g, &frames)
+          : !store_pixels(output_filename, image, frame_diff)) {
+    fclose(flog);
+    goto kill;
   }
 
   /* EXPORT Timer stop */
   gettimeofday(&t2, NULL);
+  trace_span("export", -1, t);
 
   duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
 
@@ -337,9 +871,24 @@ int main(int argc, char **argv) {
 
 kill:;
   int k = -1;
-  for (int i = 0; i < mpi_n_workers; i++)
+  // the frames left in the shared window are no longer needed
+  mpi_shared_free(shared);
+  if (workers == workers_pulling && prod == prod_rma)
+    rma_filter(1, image->n_images, images, ROOT, NULL, NULL, NULL);
+  else if (workers == workers_pulling && prod == prod_static)
+    scatter_filter(1, 0, NULL, ROOT, NULL, NULL, NULL);
+  else if (workers == workers_pulling)
+    mpi_server(mpi_n_workers, 0, NULL, ROOT, NULL, NULL, NULL, NULL);
+  for (int i = 0; workers == workers_waiting && mpi_rank == ROOT &&
+                  i < mpi_n_workers;
+       i++)
     MPI_Send(&k, 1, MPI_INT, i + 1, 0, MPI_COMM_WORLD);
 
-  MPI_Finalize();
+  if (trace_filename != NULL)
+    write_trace(trace_filename, mpi_rank, mpi_size, use_mpi);
+  if (counters && log_filename != NULL)
+    report_counters(log_filename, args[0], mpi_rank, use_mpi);
+  if (use_mpi)
+    MPI_Finalize();
   return 0;
 }
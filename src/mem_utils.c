@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "mem_utils.h"
+
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void *mem_alloc(size_t size) {
+  size_t align = MEM_ALIGN;
+  void *p;
+
+  /* Whole huge pages, so that the tail of the buffer is not split */
+  if (size >= MEM_HUGE_PAGE) {
+    align = MEM_HUGE_PAGE;
+    size = (size + MEM_HUGE_PAGE - 1) & ~(size_t)(MEM_HUGE_PAGE - 1);
+  }
+
+  if (posix_memalign(&p, align, size ? size : 1) != 0)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  /* Only advice: without transparent huge pages we keep 4 KB pages */
+  if (align == MEM_HUGE_PAGE)
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+void mem_touch(void *dst, const void *src, size_t n, size_t item_bytes) {
+#pragma omp parallel
+  {
+    size_t n_threads = omp_get_num_threads();
+    size_t t = omp_get_thread_num();
+
+    /* Same split as schedule(static): the first n % T threads get one more */
+    size_t q = n / n_threads;
+    size_t r = n % n_threads;
+    size_t begin = t * q + (t < r ? t : r);
+    size_t count = q + (t < r);
+
+    char *d = (char *)dst + begin * item_bytes;
+    if (src != NULL)
+      memcpy(d, (const char *)src + begin * item_bytes, count * item_bytes);
+    else
+      memset(d, 0, count * item_bytes);
+  }
+}
+
+pixel *mem_pixel_alloc(size_t n_pixels, void *arg) {
+  pixel *p = mem_alloc(n_pixels * sizeof(pixel));
+
+  (void)arg;
+  if (p != NULL)
+    mem_touch(p, NULL, n_pixels, sizeof(pixel));
+  return p;
+}
+
+static int cpu_socket(int cpu) {
+  char path[128];
+  FILE *f;
+  int socket = 0;
+
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  if (fscanf(f, "%d", &socket) != 1)
+    socket = 0;
+  fclose(f);
+  return socket;
+}
+
+typedef struct {
+  int cpu;
+  int socket;
+} cpu_place;
+
+static int compare_places(const void *a, const void *b) {
+  const cpu_place *pa = a;
+  const cpu_place *pb = b;
+
+  if (pa->socket != pb->socket)
+    return pa->socket - pb->socket;
+  return pa->cpu - pb->cpu;
+}
+
+/*
+ * The CPUs we may run on are sorted by socket, and thread t of T of rank r
+ * of R on the node gets CPU (r * T + t) * N / (R * T) of the N: the ranks
+ * get disjoint blocks, consecutive threads, hence consecutive row blocks,
+ * share a socket, and the sockets get a share proportional to their CPUs.
+ * A rank that the launcher already bound to part of the node keeps to its
+ * own CPUs.
+ * */
+int mem_pin_threads(const char *label, int node_rank, int node_size) {
+  cpu_set_t allowed;
+  cpu_place *places;
+  int n_places = 0;
+  int ok = 1;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    perror("sched_getaffinity");
+    return 0;
+  }
+
+  places = malloc(CPU_COUNT(&allowed) * sizeof(cpu_place));
+  if (places == NULL)
+    return 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      places[n_places].cpu = cpu;
+      places[n_places].socket = cpu_socket(cpu);
+      n_places++;
+    }
+  }
+  qsort(places, n_places, sizeof(cpu_place), compare_places);
+
+  if (n_places < sysconf(_SC_NPROCESSORS_ONLN)) {
+    node_rank = 0;
+    node_size = 1;
+  }
+
+  int n_threads = omp_get_max_threads();
+  int *placement = malloc(n_threads * sizeof(int));
+  if (placement == NULL) {
+    free(places);
+    return 0;
+  }
+
+#pragma omp parallel num_threads(n_threads) reduction(&& : ok)
+  {
+    int t = omp_get_thread_num(), n = omp_get_num_threads();
+    int i = ((long)node_rank * n + t) * n_places / ((long)node_size * n);
+    cpu_set_t set;
+
+#pragma omp single nowait
+    n_threads = omp_get_num_threads();
+
+    CPU_ZERO(&set);
+    CPU_SET(places[i].cpu, &set);
+    ok = sched_setaffinity(0, sizeof(set), &set) == 0;
+    placement[t] = i;
+  }
+
+  if (!ok)
+    fprintf(stderr, "Unable to pin the OMP threads\n");
+  else if (label != NULL)
+    for (int t = 0; t < n_threads; t++)
+      printf("%s: thread %d pinned on cpu %d (socket %d)\n", label, t,
+             places[placement[t]].cpu, places[placement[t]].socket);
+
+  free(placement);
+  free(places);
+  return ok;
+}
@@ -1,79 +1,687 @@
+#include <limits.h>
 #include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "utils.h"
+#include "gif_frames.h"
+#include "mem_utils.h"
 #include "mpi_utils.h"
+#include "omp_utils.h"
+#include "trace_utils.h"
+#include "tune_utils.h"
 
-void mpi_worker(int rank, void (*pipe)(img*)) {
-  int size = 0; // size of the incomming message
-  for (;;) {
-    // receive the size of the next message
-    MPI_Recv(&size, 1, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, NULL);
-    if (size < 0)
-      return;
+/*
+ * Frames of the root in a shared window of the ranks on its node: a table
+ * of the byte offset of each frame, then a slot for each frame, on
+ * MEM_ALIGN bytes. A frame moves to its slot when it is first sent by
+ * index, and the root uses the slot as the frame from then on. Ranks of
+ * the other nodes have no base.
+ * */
+struct shared_frames {
+  MPI_Comm node; /* ranks sharing memory with this one */
+  MPI_Win win;
+  char *base;   /* window of the root, NULL when on another node */
+  int *local;   /* root only: whether each world rank shares its node */
+  int n_local;  /* root only: workers on the node of the root */
+  unsigned char *moved; /* root only: frames living in their slot */
+};
 
-    // receive the package
-    img_pkg pack = malloc(sizeof(int) * size);
-    MPI_Recv(pack, size, MPI_INT, 0, MPI_ANY_TAG, MPI_COMM_WORLD, NULL);
+static size_t shared_align(size_t size) {
+  return (size + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+}
+
+static pixel *shared_frame(const shared_frames *sh, int id) {
+  return (pixel *)(sh->base + ((const size_t *)sh->base)[id]);
+}
+
+/*
+ * Collective over MPI_COMM_WORLD: the root sizes the window for its
+ * images, if share is set and a worker shares its node; the others
+ * allocate nothing and map the segment of the root.
+ * */
+static void shared_open(shared_frames *sh, int n_images, const img *images,
+                        int share) {
+  MPI_Group world_group, node_group;
+  int rank, world_size, node_size, root_in_node, root = 0;
+  MPI_Aint size = 0;
+  void *base;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &sh->node);
+  MPI_Comm_size(sh->node, &node_size);
+  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Comm_group(sh->node, &node_group);
+  MPI_Group_translate_ranks(world_group, 1, &root, node_group, &root_in_node);
+
+  sh->local = NULL;
+  sh->n_local = 0;
+  sh->moved = NULL;
+  if (rank == 0) {
+    int *world = malloc(sizeof(int) * world_size);
+    sh->local = malloc(sizeof(int) * world_size);
+    for (int i = 0; i < world_size; i++)
+      world[i] = i;
+    MPI_Group_translate_ranks(world_group, world_size, world, node_group,
+                              sh->local);
+    for (int i = 0; i < world_size; i++) {
+      sh->local[i] = i != 0 && sh->local[i] != MPI_UNDEFINED;
+      sh->n_local += sh->local[i];
+    }
+    free(world);
+    sh->moved = calloc(n_images + 1, 1);
+
+    if (share && sh->n_local > 0) {
+      size = shared_align(sizeof(size_t) * n_images);
+      for (int i = 0; i < n_images; i++)
+        size += shared_align(sizeof(pixel) * images[i].width *
+                             images[i].height);
+    }
+  }
+  MPI_Group_free(&world_group);
+  MPI_Group_free(&node_group);
+
+  MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, sh->node, &base, &sh->win);
+  sh->base = NULL;
+  if (root_in_node != MPI_UNDEFINED && node_size > 1) {
+    MPI_Aint root_size;
+    int disp_unit;
+    MPI_Win_shared_query(sh->win, root_in_node, &root_size, &disp_unit,
+                         &base);
+    if (root_size > 0)
+      sh->base = base;
+  }
+  /* Passive epoch for the whole run, MPI_Win_sync orders the accesses */
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, sh->win);
 
-    // convert it to an image
-    pixel *p = malloc(sizeof(int) * sizeofp(size));
-    img image = {0, 0, 0, p};
-    pkg2img(pack, &image, NULL);
+  if (rank == 0 && sh->base != NULL) {
+    size_t *offsets = (size_t *)sh->base;
+    size_t offset = shared_align(sizeof(size_t) * n_images);
+    for (int i = 0; i < n_images; i++) {
+      offsets[i] = offset;
+      offset += shared_align(sizeof(pixel) * images[i].width *
+                             images[i].height);
+    }
+    MPI_Win_sync(sh->win);
+  }
+}
+
+/* Move frame id of the root to its slot, where the workers read it */
+static void shared_move(shared_frames *sh, img *images, int id) {
+  pixel *slot = shared_frame(sh, id);
+
+  memcpy(slot, images[id].p,
+         sizeof(pixel) * images[id].width * images[id].height);
+  free(images[id].p);
+  images[id].p = slot;
+  sh->moved[id] = 1;
+}
 
-    // run the pipeline
-    pipe(&image);
+static void shared_close(shared_frames *sh) {
+  MPI_Win_unlock_all(sh->win);
+  MPI_Win_free(&sh->win);
+  MPI_Comm_free(&sh->node);
+  free(sh->local);
+  free(sh->moved);
+}
 
-    // convert back to package
-    img2pkg(image, pack, rank);
+/* Growable buffer of a batch message */
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+} batch_buf;
 
-    // send it back to root
-    MPI_Send(pack, size, MPI_INT, 0, 0, MPI_COMM_WORLD);
-    free(pack);
+/* Room for n more bytes at the end of b, NULL when out of memory */
+static void *batch_grow(batch_buf *b, size_t n) {
+  if (b->size + n > b->capacity) {
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->size + n)
+      capacity *= 2;
+    char *data = realloc(b->data, capacity);
+    if (data == NULL)
+      return NULL;
+    b->data = data;
+    b->capacity = capacity;
   }
+  b->size += n;
+  return b->data + b->size - n;
 }
 
-void mpi_server(int n_workers, int n_images, img *images, int root) {
-  /* receive and send new images in loop */
-  int max_size_image = 0;
-  int s;
+static void batch_put_int(batch_buf *b, int value) {
+  int *p = batch_grow(b, sizeof(int));
+  if (p != NULL)
+    *p = value;
+}
 
-  for (int i = 0; i < n_images; i++)
-    if (max_size_image < (s = sizeofimg(images[i])))
-      max_size_image = s;
-  img_pkg pack = malloc(sizeof(int) * max_size_image);
+/*
+ * Filter one entry of a batch: a frame sent by index, decoded here or
+ * copied out of its slot, or a package. Its result is appended to out,
+ * in the format of the returned tag, with the LZW blocks of encoded frames
+ * going to blocks.
+ * */
+static int filter_entry(const int *entry, int len, int thread, int n_threads,
+                        pipe_fn pipe, const filter_params *params,
+                        const shared_frames *sh, const gif_frames *frames,
+                        batch_buf *out, batch_buf *blocks) {
+  img image;
+  size_t n;
 
-  // sending initial pack of images
-  for (int i = 0; i < n_workers && i < n_images; i++) {
-    s = sizeofimg(images[i]);
+  if (len == MPI_FRAME_INDEX_SIZE) {
+    // only the index: decode the frame or copy it out of the window
+    n = (size_t)entry[1] * entry[2];
+    image = (img){entry[1], entry[2], entry[0], mem_alloc(sizeof(pixel) * n)};
+    if (frames != NULL) {
+      if (!gif_frames_decode(frames, image.id, image.p))
+        memset(image.p, 0, sizeof(pixel) * n);
+    } else {
+      MPI_Win_sync(sh->win);
+      if (n_threads == 1)
+        mem_touch(image.p, shared_frame(sh, image.id), n, sizeof(pixel));
+      else
+        memcpy(image.p, shared_frame(sh, image.id), sizeof(pixel) * n);
+    }
+  } else {
+    // convert the package to an image
+    n = sizeofp(len) / 3;
+    image = (img){0, 0, 0, mem_alloc(sizeof(pixel) * n)};
+    if (n_threads == 1)
+      mem_touch(image.p, NULL, n, sizeof(pixel));
+    pkg2img((img_pkg)entry, &image, NULL);
+  }
 
-    // gettimeofday(&t1, NULL);
+  // run the pipeline
+  pipe(&image, params);
 
-    img2pkg(images[i], pack, root);
+  int tag;
+  if (frames != NULL) {
+    // encoded, the root only concatenates it
+    size_t n_bytes = 0;
+    double t = trace_now();
+    unsigned char *encoded =
+        gif_frames_encode(image.p, image.width, image.height,
+                          frames->interlace[image.id], &n_bytes);
+    trace_span("encode", image.id, t);
+    void *dst = encoded != NULL ? batch_grow(blocks, n_bytes) : NULL;
+    if (dst != NULL)
+      memcpy(dst, encoded, n_bytes);
+    else
+      n_bytes = 0;
+    batch_put_int(out, image.id);
+    batch_put_int(out, n_bytes);
+    free(encoded);
+    tag = MPI_TAG_ENCODED;
+  } else if (len == MPI_FRAME_INDEX_SIZE) {
+    // the pipes swap their buffers, so copy the result back to the slot
+    memcpy(shared_frame(sh, image.id), image.p, sizeof(pixel) * n);
+    MPI_Win_sync(sh->win);
+    batch_put_int(out, image.id);
+    tag = MPI_TAG_SHARED_DONE;
+  } else {
+    img_pkg pack = batch_grow(out, sizeof(int) * sizeofimg(image));
+    if (pack != NULL)
+      img2pkg(image, pack, thread);
+    tag = MPI_TAG_RESULT;
+  }
+  free(image.p);
+  return tag;
+}
 
-    /* gettimeofday(&t2, NULL);
-    duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
-    printf("Conversion to pkg%f\n", duration); */
+/*
+ * One frame-processing thread of a worker rank: it asks the root for a
+ * batch of frames, filters them, and sends them back in one message, which
+ * also asks for the next batch. Batches for this thread come on its own
+ * tag, so the threads of a rank never receive each other's messages.
+ *
+ * The thread keeps MPI_BATCHES_AHEAD requests out, so the batch after the
+ * current one is on its way while it filters, even when the root is busy
+ * filtering a frame of its own. The results leave without waiting for the
+ * root either, each of their buffers being reused once its send is done.
+ * */
+static void worker_thread(int thread, int n_threads, pipe_fn pipe,
+                          const filter_params *params,
+                          const shared_frames *sh, const gif_frames *frames) {
+  int hello[2] = {thread, n_threads};
+  batch_buf in = {0}, out[MPI_BATCHES_AHEAD] = {{0}}, blocks = {0};
+  MPI_Request sent[MPI_BATCHES_AHEAD];
+  int asked, turn = 0;
 
-    MPI_Send(&s, 1, MPI_INT, i + 1, 0, MPI_COMM_WORLD);
-    MPI_Send(pack, s, MPI_INT, i + 1, 0, MPI_COMM_WORLD);
+  for (asked = 0; asked < MPI_BATCHES_AHEAD; asked++) {
+    sent[asked] = MPI_REQUEST_NULL;
+    MPI_Send(hello, 2, MPI_INT, 0, MPI_TAG_REQUEST, MPI_COMM_WORLD);
   }
 
-  // recv-send loop for dynamic allocation
-  for (int i = 0; i < n_images; i++) {
-    s = sizeofimg(images[i]);
-    int sender_rank;
-    MPI_Recv(pack, s, MPI_INT, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD,
-             NULL);
-    pkg2img(pack, &images[i], &sender_rank);
+  while (asked > 0) {
+    MPI_Message message;
+    MPI_Status status;
+    int size, tag = MPI_TAG_RESULT;
 
-    if (i + n_workers >= n_images)
+    // receive the next batch of this thread, an empty one means stop
+    double t = trace_now();
+    MPI_Mprobe(0, MPI_TAG_FRAME + thread, MPI_COMM_WORLD, &message, &status);
+    MPI_Get_count(&status, MPI_INT, &size);
+    in.size = 0;
+    int *batch = batch_grow(&in, sizeof(int) * size);
+    MPI_Mrecv(batch, size, MPI_INT, &message, MPI_STATUS_IGNORE);
+    trace_span("wait", -1, t);
+    asked--;
+    // the root has nothing left, its answers to the other requests neither
+    if (batch[0] == 0)
       continue;
 
-    s = sizeofimg(images[i + n_workers]);
-    img2pkg(images[i + n_workers], pack, root);
-    MPI_Send(&s, 1, MPI_INT, sender_rank, 0, MPI_COMM_WORLD);
-    MPI_Send(pack, s, MPI_INT, sender_rank, 0, MPI_COMM_WORLD);
+    // results go back behind {thread, count}, once the buffer is free
+    batch_buf *o = &out[turn];
+    MPI_Wait(&sent[turn], MPI_STATUS_IGNORE);
+    o->size = 0;
+    blocks.size = 0;
+    batch_put_int(o, thread);
+    batch_put_int(o, batch[0]);
+
+    const int *entry = batch + 1;
+    for (int e = 0; e < batch[0]; e++) {
+      tag = filter_entry(entry + 1, entry[0], thread, n_threads, pipe, params,
+                         sh, frames, o, &blocks);
+      entry += entry[0] + 1;
+    }
+
+    t = trace_now();
+    if (tag == MPI_TAG_ENCODED) {
+      void *dst = batch_grow(o, blocks.size);
+      if (dst != NULL)
+        memcpy(dst, blocks.data, blocks.size);
+      MPI_Isend(o->data, o->size, MPI_BYTE, 0, tag, MPI_COMM_WORLD,
+                &sent[turn]);
+    } else {
+      MPI_Isend(o->data, o->size / sizeof(int), MPI_INT, 0, tag,
+                MPI_COMM_WORLD, &sent[turn]);
+    }
+    trace_span("send", -1, t);
+    asked++;
+    turn = (turn + 1) % MPI_BATCHES_AHEAD;
+  }
+  MPI_Waitall(MPI_BATCHES_AHEAD, sent, MPI_STATUSES_IGNORE);
+  free(in.data);
+  for (int i = 0; i < MPI_BATCHES_AHEAD; i++)
+    free(out[i].data);
+  free(blocks.data);
+}
+
+typedef struct {
+  pipe_fn pipe;
+  const filter_params *params;
+  const shared_frames *sh;
+  const gif_frames *frames;
+} worker_args;
+
+static void worker_team(void *arg) {
+  const worker_args *w = arg;
+
+  worker_thread(omp_get_thread_num(), omp_get_num_threads(), w->pipe,
+                w->params, w->sh, w->frames);
+}
+
+void mpi_worker(int n_threads, pipe_fn pipe, const filter_params *params,
+                const gif_frames *frames) {
+  shared_frames sh;
+
+  shared_open(&sh, 0, NULL, 0);
+
+  worker_args w = {pipe, params, &sh, frames};
+  omp_run_team(n_threads, worker_team, &w);
+
+  shared_close(&sh);
+}
+
+/*
+ * Batches on their way to the workers, which may be filtering the one
+ * before: the root does not wait for them, and reuses a buffer once its
+ * batch is sent.
+ * */
+typedef struct {
+  batch_buf *bufs;
+  MPI_Request *requests;
+  int n;
+  int capacity;
+} send_pool;
+
+/* A buffer whose batch has left, with the request of its next send */
+static batch_buf *pool_get(send_pool *pool, MPI_Request **request) {
+  for (int i = 0; i < pool->n; i++) {
+    int done;
+    MPI_Test(&pool->requests[i], &done, MPI_STATUS_IGNORE);
+    if (done) {
+      *request = &pool->requests[i];
+      return &pool->bufs[i];
+    }
   }
 
-  free(pack);
+  if (pool->n == pool->capacity) {
+    int capacity = pool->capacity ? 2 * pool->capacity : 16;
+    batch_buf *bufs = realloc(pool->bufs, sizeof(batch_buf) * capacity);
+    if (bufs != NULL)
+      pool->bufs = bufs;
+    MPI_Request *requests =
+        realloc(pool->requests, sizeof(MPI_Request) * capacity);
+    if (requests != NULL)
+      pool->requests = requests;
+    // out of memory: wait for every batch and reuse the first buffer
+    if (bufs == NULL || requests == NULL) {
+      MPI_Waitall(pool->n, pool->requests, MPI_STATUSES_IGNORE);
+      *request = &pool->requests[0];
+      return &pool->bufs[0];
+    }
+    pool->capacity = capacity;
+  }
+  pool->bufs[pool->n] = (batch_buf){0};
+  pool->requests[pool->n] = MPI_REQUEST_NULL;
+  *request = &pool->requests[pool->n];
+  return &pool->bufs[pool->n++];
+}
+
+static void pool_free(send_pool *pool) {
+  MPI_Waitall(pool->n, pool->requests, MPI_STATUSES_IGNORE);
+  for (int i = 0; i < pool->n; i++)
+    free(pool->bufs[i].data);
+  free(pool->bufs);
+  free(pool->requests);
+}
+
+/*
+ * Batch of the k frames of ids for a thread of rank dest, by index or in
+ * packages: {k, length, entry, length, entry, ...}.
+ * */
+static void send_batch(const img *images, const int *ids, int k, int dest,
+                       int thread, int by_index, send_pool *pool, int root) {
+  MPI_Request *request;
+  batch_buf *out = pool_get(pool, &request);
+  double t = trace_now();
+
+  out->size = 0;
+  batch_put_int(out, k);
+  for (int e = 0; e < k; e++) {
+    const img *image = &images[ids[e]];
+    if (by_index) {
+      batch_put_int(out, MPI_FRAME_INDEX_SIZE);
+      batch_put_int(out, ids[e]);
+      batch_put_int(out, image->width);
+      batch_put_int(out, image->height);
+    } else {
+      batch_put_int(out, sizeofimg(*image));
+      img_pkg pack = batch_grow(out, sizeof(int) * sizeofimg(*image));
+      if (pack != NULL)
+        img2pkg(*image, pack, root);
+    }
+  }
+  MPI_Isend(out->data, out->size / sizeof(int), MPI_INT, dest,
+            MPI_TAG_FRAME + thread, MPI_COMM_WORLD, request);
+  trace_span("send", -1, t);
+}
+
+/* Bytes of frames per batch, from the latency and bandwidth measured */
+static double batch_target(void) {
+  double target = tune_batch_bytes();
+
+  if (target < 0)
+    return MPI_BATCH_BYTES;
+  if (target < MPI_BATCH_MIN_BYTES)
+    return MPI_BATCH_MIN_BYTES;
+  return target > MPI_BATCH_MAX_BYTES ? MPI_BATCH_MAX_BYTES : target;
+}
+
+/* Progress of the frames, shared by the result handlers of mpi_server */
+typedef struct {
+  unsigned char *done;   /* a result was kept */
+  unsigned char *copied; /* a speculative copy was sent */
+  int *owner;            /* rank << 16 | thread of the first dispatch */
+  int received;
+  int n_copies;
+  int n_won; /* results of copies that came first */
+} frame_progress;
+
+/* Whether the result of frame id by who is the first, to be kept */
+static int frame_accept(frame_progress *fp, int id, int who) {
+  if (fp->done[id])
+    return 0;
+  fp->done[id] = 1;
+  fp->received++;
+  if (fp->copied[id] && fp->owner[id] != who)
+    fp->n_won++;
+  return 1;
+}
+
+/* Filter frame i on the root, and encode it when the workers would */
+static void root_frame(img *images, int i, pipe_fn pipe,
+                       const filter_params *params, gif_frames *frames) {
+  if (frames != NULL)
+    gif_frames_decode(frames, i, images[i].p);
+  pipe(&images[i], params);
+  if (frames != NULL) {
+    double t = trace_now();
+    frames->encoded[i] =
+        gif_frames_encode(images[i].p, images[i].width, images[i].height,
+                          frames->interlace[i], &frames->encoded_size[i]);
+    trace_span("encode", i, t);
+  }
+}
+
+/*
+ * Whether the messages carrying frame i keep int counts: its package, or
+ * its LZW blocks (at most 12 bits per pixel, plus the sub-block lengths)
+ * when the workers decode, with room for the rest of a batch, which holds
+ * less than MPI_BATCH_MAX_BYTES before its last frame.
+ * */
+static int frame_fits(const img *image, const gif_frames *frames) {
+  long n = (long)image->width * image->height;
+
+  if (frames != NULL)
+    return n <= INT_MAX / 4;
+  return sizeofimg(*image) <= INT_MAX / 2;
+}
+
+/*
+ * Serve the frames to the worker threads in order, each request or result
+ * being answered with the next batch of frames or with a stop once all
+ * are handed out. Returns when every thread of every worker has been
+ * stopped, so it also releases the workers when there is nothing to
+ * filter. Workers on the node of the root get only frame indices, the
+ * frames themselves staying in a shared window. In between, the
+ * root filters frames from the end with pipe, unless it is NULL.
+ *
+ * Batches hold consecutive frames up to batch_target bytes, but no more
+ * than half of a fair share of the frames left, so that the end of the
+ * run stays balanced.
+ *
+ * Once the queue is empty, threads asking for more get a copy of the
+ * oldest frame still out instead of a stop: the first result wins and
+ * the late one is dropped. Copies always travel as packages (or by index
+ * when the workers decode), so two threads never share a window slot.
+ * */
+void mpi_server(int n_workers, int n_images, img *images, int root,
+                pipe_fn pipe, const filter_params *params,
+                gif_frames *frames, shared_frames **shared) {
+  int *threads = calloc(n_workers + 1, sizeof(int));
+  int registered = 0, n_threads = 0, stopped = 0;
+  int next = 0, last = n_images, oldest = 0;
+  frame_progress fp = {calloc(n_images + 1, 1), calloc(n_images + 1, 1),
+                       calloc(n_images + 1, sizeof(int)), 0, 0, 0};
+  int *ids = malloc(sizeof(int) * (n_images + 1));
+  double target = batch_target();
+  batch_buf in = {0};
+  send_pool pool = {0};
+  shared_frames sh, *kept = NULL;
+
+  // MPI counts are ints: frames that do not fit them all stay on the root
+  for (int i = 0; i < n_images && pipe != NULL; i++) {
+    if (frame_fits(&images[i], frames))
+      continue;
+    fprintf(stderr, "Frames too large to send, filtering on the root\n");
+    for (int j = 0; j < n_images; j++) {
+      root_frame(images, j, pipe, params, frames);
+      frame_accept(&fp, j, -1);
+    }
+    next = last = oldest = n_images;
+    break;
+  }
+
+  // the window outlives the server when frames may be left in it
+  if (shared != NULL)
+    *shared = NULL;
+  if (shared != NULL && frames == NULL && next < last)
+    kept = malloc(sizeof(shared_frames));
+  shared_open(&sh, n_images, images, kept != NULL);
+
+  while (fp.received < n_images || registered < n_workers ||
+         stopped < n_threads * MPI_BATCHES_AHEAD) {
+    MPI_Status status;
+    int thread = 0, pending, s;
+
+    /*
+     * Nobody waiting: filter the last frame not handed out yet, as long as
+     * every worker thread still has one to take after it, so that the
+     * root never holds back the end of the run.
+     * */
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &pending,
+               &status);
+    if (!pending && pipe != NULL && registered == n_workers &&
+        last - next > n_threads) {
+      last--;
+      root_frame(images, last, pipe, params, frames);
+      frame_accept(&fp, last, -1);
+      continue;
+    }
+    if (!pending) {
+      double t = trace_now();
+      MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+      trace_span("wait", -1, t);
+    }
+
+    // encoded frames come as bytes, everything else as ints
+    int source = status.MPI_SOURCE;
+    MPI_Datatype type = status.MPI_TAG == MPI_TAG_ENCODED ? MPI_BYTE : MPI_INT;
+    MPI_Get_count(&status, type, &s);
+    in.size = 0;
+    int *msg = batch_grow(&in, type == MPI_INT ? sizeof(int) * s : (size_t)s);
+    double t = trace_now();
+    MPI_Recv(msg, s, type, source, status.MPI_TAG, MPI_COMM_WORLD,
+             MPI_STATUS_IGNORE);
+    trace_span("recv", -1, t);
+    thread = msg[0];
+    int who = source << 16 | thread;
+
+    if (status.MPI_TAG == MPI_TAG_REQUEST) {
+      if (threads[source] == 0) {
+        threads[source] = msg[1];
+        n_threads += msg[1];
+        registered++;
+      }
+    } else if (status.MPI_TAG == MPI_TAG_ENCODED) {
+      // keep the sub-blocks of each frame for the writer
+      const unsigned char *block = (unsigned char *)(msg + 2 + 2 * msg[1]);
+      for (int e = 0; e < msg[1]; e++) {
+        int id = msg[2 + 2 * e], n_bytes = msg[3 + 2 * e];
+        if (frame_accept(&fp, id, who)) {
+          frames->encoded_size[id] = n_bytes;
+          frames->encoded[id] = malloc(n_bytes + 1);
+          memcpy(frames->encoded[id], block, n_bytes);
+        }
+        block += n_bytes;
+      }
+    } else if (status.MPI_TAG == MPI_TAG_SHARED_DONE) {
+      // written back to their slots, which the frames already point to
+      MPI_Win_sync(sh.win);
+      for (int e = 0; e < msg[1]; e++)
+        frame_accept(&fp, msg[2 + e], who);
+    } else {
+      // filtered frames go back to their slots
+      img_pkg pack = msg + 2;
+      for (int e = 0; e < msg[1]; e++) {
+        if (frame_accept(&fp, pack[2], who))
+          pkg2img(pack, &images[pack[2]], NULL);
+        pack += 3 * pack[0] * pack[1] + 4;
+      }
+    }
+
+    // frames in their slots are not raced, the slot being their only copy
+    while (oldest < next &&
+           (fp.done[oldest] || fp.copied[oldest] || sh.moved[oldest]))
+      oldest++;
+
+    if (next < last) {
+      int fair = (last - next) / (2 * (n_threads > 0 ? n_threads : 1));
+      double bytes = 0;
+      int k = 0;
+
+      while (next < last && (k == 0 || (k < fair && bytes < target))) {
+        bytes += sizeof(int) * (double)sizeofimg(images[next]);
+        fp.owner[next] = who;
+        ids[k++] = next++;
+      }
+      int by_index = frames != NULL || (sh.base != NULL && sh.local[source]);
+      if (frames == NULL && by_index) {
+        for (int e = 0; e < k; e++)
+          shared_move(&sh, images, ids[e]);
+        MPI_Win_sync(sh.win);
+      }
+      send_batch(images, ids, k, source, thread, by_index, &pool, root);
+    } else if (oldest < next) {
+      // idle at the tail: race the oldest frame still out
+      send_batch(images, &oldest, 1, source, thread, frames != NULL, &pool,
+                 root);
+      fp.copied[oldest] = 1;
+      fp.n_copies++;
+    } else {
+      send_batch(images, NULL, 0, source, thread, 0, &pool, root);
+      stopped++;
+    }
+  }
+
+  if (fp.n_copies > 0)
+    printf("Speculative copies: %d, finished first: %d\n", fp.n_copies,
+           fp.n_won);
+
+  pool_free(&pool);
+  if (kept != NULL) {
+    *kept = sh;
+    *shared = kept;
+  } else {
+    shared_close(&sh);
+  }
+  free(threads);
+  free(ids);
+  free(in.data);
+  free(fp.done);
+  free(fp.copied);
+  free(fp.owner);
+}
+
+void mpi_shared_free(shared_frames *shared) {
+  if (shared == NULL)
+    return;
+  shared_close(shared);
+  free(shared);
+}
+
+int mpi_launched(void) {
+  /* World size exported by Open MPI, MPICH/Intel MPI (PMI) and MVAPICH */
+  static const char *size_vars[] = {"OMPI_COMM_WORLD_SIZE", "PMI_SIZE",
+                                    "MV2_COMM_WORLD_SIZE"};
+  /* Launchers that only export the rank: assume several ranks */
+  static const char *rank_vars[] = {"PMIX_RANK", "PMI_RANK"};
+  const char *force = getenv("SOBELF_MPI");
+
+  if (force != NULL)
+    return strcmp(force, "0") != 0;
+
+  for (size_t i = 0; i < sizeof(size_vars) / sizeof(size_vars[0]); i++) {
+    const char *size = getenv(size_vars[i]);
+    if (size != NULL)
+      return atoi(size) > 1;
+  }
+  for (size_t i = 0; i < sizeof(rank_vars) / sizeof(rank_vars[0]); i++)
+    if (getenv(rank_vars[i]) != NULL)
+      return 1;
+  return 0;
 }
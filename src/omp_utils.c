@@ -1,5 +1,8 @@
 #include "omp_utils.h"
+#include "blur_kernels.h"
 #include "filters.h"
+#include "mem_utils.h"
+#include "trace_utils.h"
 
 #include <math.h>
 #include <omp.h>
@@ -7,10 +10,20 @@
 #include <stdlib.h>
 #include <string.h>
 
-void omp_server(int n_images, img *images, void (*pipe)(img *)) {
+void omp_run_team(int n_threads, void (*fn)(void *arg), void *arg) {
+  if (n_threads <= 1) {
+    fn(arg);
+    return;
+  }
+#pragma omp parallel num_threads(n_threads)
+  fn(arg);
+}
+
+void omp_server(int n_images, img *images, pipe_fn pipe,
+                const filter_params *params) {
 #pragma omp parallel for
   for (int i = 0; i < n_images; i++) {
-    pipe(images + i);
+    pipe(images + i, params);
   }
 }
 
@@ -29,7 +42,6 @@ void gray_filter_helper(pixel *p) {
 }
 
 void omp_apply_gray_filter(img *image) {
-  int j;
   pixel *p;
   int width, height;
 
@@ -38,129 +50,107 @@ void omp_apply_gray_filter(img *image) {
   height = image->height;
 
 #pragma omp parallel for firstprivate(width, height)
-  for (j = 0; j < width * height; j++)
+  for (size_t j = 0; j < (size_t)width * height; j++)
     gray_filter_helper(&p[j]);
 }
 
+/*
+ * One parallel region for all the iterations: the rows of both bands are
+ * shared with a static schedule and each thread raises the change flag of
+ * the iteration at most once. The flags rotate over three slots, so the
+ * one reset during an iteration was last read two iterations ago and a
+ * single barrier per iteration is enough.
+ */
 void omp_apply_blur_filter(img *image, int size, int threshold) {
-  int end = 0;
-  int n_iter = 0;
   int width = image->width;
   int height = image->height;
   pixel *p = image->p;
-  pixel *new = (pixel *)malloc(width * height * sizeof(pixel));
-  memcpy(new, p, width * height * sizeof(pixel));
-
-  do {
-    end = 1;
-    n_iter++;
-
-    /* Apply blur on top AND bottom part of image (10%) */
-#pragma GCC unroll 2
-    for (int j_idx = 0; j_idx < 2; j_idx++) {
-
-#pragma omp parallel for collapse(2)
-      for (int j = size; j < height / 10 - size; j++) {
-        for (int k = size; k < width - size; k++) {
-          int js[] = {j, height - j - 1};
-          int j_true = js[j_idx];
-
-          int t_r = 0;
-          int t_g = 0;
-          int t_b = 0;
-
-          for (int stencil_j = -size; stencil_j <= size; stencil_j++) {
-            for (int stencil_k = -size; stencil_k <= size; stencil_k++) {
-              t_r += p[CONV(j_true + stencil_j, k + stencil_k, width)].r;
-              t_g += p[CONV(j_true + stencil_j, k + stencil_k, width)].g;
-              t_b += p[CONV(j_true + stencil_j, k + stencil_k, width)].b;
-            }
-          }
-
-          new[CONV(j_true, k, width)].r =
-              t_r / ((2 * size + 1) * (2 * size + 1));
-          new[CONV(j_true, k, width)].g =
-              t_g / ((2 * size + 1) * (2 * size + 1));
-          new[CONV(j_true, k, width)].b =
-              t_b / ((2 * size + 1) * (2 * size + 1));
-
-          // calculate diffs direclty
-          float diff_r =
-              (new[CONV(j_true, k, width)].r - p[CONV(j_true, k, width)].r);
-          float diff_g =
-              (new[CONV(j_true, k, width)].g - p[CONV(j_true, k, width)].g);
-          float diff_b =
-              (new[CONV(j_true, k, width)].b - p[CONV(j_true, k, width)].b);
-
-          if (diff_r > threshold || -diff_r > threshold || diff_g > threshold ||
-              -diff_g > threshold || diff_b > threshold ||
-              -diff_b > threshold) {
-            end = 0;
-          }
-        }
-      }
+  pixel *new = mem_alloc((size_t)width * height * sizeof(pixel));
+
+  /* Stencil specialised for this radius */
+  const blur_kernel kernel = make_blur_kernel(size, threshold);
+
+  /* Rows of one band, blurred on top AND bottom part of image (10%) */
+  const int n_rows = height / 10 - 2 * size > 0 ? height / 10 - 2 * size : 0;
+  int changed[3] = {0, 0, 0};
+
+#pragma omp parallel firstprivate(p, new)
+  {
+    int iter = 0;
+    int end;
+
+    /* First touch the band rows with the schedule of the blur loop */
+#pragma omp for schedule(static) nowait
+    for (int i = 0; i < 2 * n_rows; i++) {
+      int j = i < n_rows ? size + i : height - size - (i - n_rows) - 1;
+
+      memcpy(new + (size_t)j * width, p + (size_t)j * width,
+             width * sizeof(pixel));
     }
-    pixel *tmp = p;
-    p = new;
-    new = tmp;
-  } while (threshold > 0 && !end);
+#pragma omp for schedule(static)
+    for (int j = 0; j < height; j++) {
+      if ((j >= size && j < size + n_rows) ||
+          (j >= height - size - n_rows && j < height - size))
+        continue;
+      memcpy(new + (size_t)j * width, p + (size_t)j * width,
+             width * sizeof(pixel));
+    }
+
+    do {
+      double t = trace_now();
+      int local = 0;
+
+#pragma omp for schedule(static) nowait
+      for (int i = 0; i < 2 * n_rows; i++) {
+        int j = i < n_rows ? size + i : height - size - (i - n_rows) - 1;
+
+        local |= kernel.row(&kernel, p, new, j, width);
+      }
 
+      if (local) {
+#pragma omp atomic write
+        changed[iter % 3] = 1;
+      }
+#pragma omp master
+      changed[(iter + 1) % 3] = 0;
+
+#pragma omp barrier
+
+      /* Nobody writes this slot again before the next barrier */
+      end = !changed[iter % 3];
+
+      pixel *tmp = p;
+      p = new;
+      new = tmp;
+      iter++;
+#pragma omp master
+      trace_span("blur iteration", image->id, t);
+    } while (threshold > 0 && !end);
+
+#pragma omp master
+    {
 #if SOBELF_DEBUG
-  printf("BLUR: number of iterations for image %d\n", n_iter);
+      printf("BLUR: number of iterations for image %d\n", iter);
 #endif
-
-  free(new);
-  image->p = p;
+      image->p = p;
+      free(new);
+    }
+  }
 }
 
-void omp_apply_sobel_filter(img *image) {
+void omp_apply_sobel_filter(img *image, int threshold) {
   pixel *p = image->p;
   int width = image->width;
   int height = image->height;
 
-  pixel *sobel = (pixel *)malloc(width * height * sizeof(pixel));
-  memcpy(sobel, p,width * height * sizeof(pixel));
-
-#pragma omp parallel for collapse(2)
-  for (int j = 1; j < height - 1; j++) {
-    for (int k = 1; k < width - 1; k++) {
-      int pixel_blue_no, pixel_blue_n, pixel_blue_ne;
-      int pixel_blue_so, pixel_blue_s, pixel_blue_se;
-      int pixel_blue_o, pixel_blue_e;
-
-      float deltaX_blue;
-      float deltaY_blue;
-      float val_blue;
-
-      pixel_blue_no = p[CONV(j - 1, k - 1, width)].b;
-      pixel_blue_n = p[CONV(j - 1, k, width)].b;
-      pixel_blue_ne = p[CONV(j - 1, k + 1, width)].b;
-      pixel_blue_so = p[CONV(j + 1, k - 1, width)].b;
-      pixel_blue_s = p[CONV(j + 1, k, width)].b;
-      pixel_blue_se = p[CONV(j + 1, k + 1, width)].b;
-      pixel_blue_o = p[CONV(j, k - 1, width)].b;
-      pixel_blue_e = p[CONV(j, k + 1, width)].b;
-
-      deltaX_blue = -pixel_blue_no + pixel_blue_ne - 2 * pixel_blue_o +
-                    2 * pixel_blue_e - pixel_blue_so + pixel_blue_se;
-
-      deltaY_blue = pixel_blue_se + 2 * pixel_blue_s + pixel_blue_so -
-                    pixel_blue_ne - 2 * pixel_blue_n - pixel_blue_no;
-
-      val_blue =
-          sqrt(deltaX_blue * deltaX_blue + deltaY_blue * deltaY_blue) / 4;
-
-      if (val_blue > 50) {
-        sobel[CONV(j, k, width)].r = 255;
-        sobel[CONV(j, k, width)].g = 255;
-        sobel[CONV(j, k, width)].b = 255;
-      } else {
-        sobel[CONV(j, k, width)].r = 0;
-        sobel[CONV(j, k, width)].g = 0;
-        sobel[CONV(j, k, width)].b = 0;
-      }
-    }
-  }
+  pixel *sobel = mem_alloc((size_t)width * height * sizeof(pixel));
+  mem_touch(sobel, p, height, width * sizeof(pixel));
+
+  const int limit = sobel_limit(threshold);
+
+#pragma omp parallel for
+  for (int j = 1; j < height - 1; j++)
+    sobel_row(p, sobel, j, width, limit);
 
   free(p);
   image->p = sobel;
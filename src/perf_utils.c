@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include "perf_utils.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Fields of a stage in the totals */
+enum perf_field {
+  field_seconds,
+  field_pixels,
+  field_counted_seconds, /* of the threads that had counters */
+  field_counted_pixels,
+  field_cycles,
+  field_instructions,
+  field_misses
+};
+
+static const char *stage_names[n_perf_stages] = {"gray", "blur", "sobel",
+                                                 "palette", "lzw"};
+static const uint64_t events[] = {PERF_COUNT_HW_CPU_CYCLES,
+                                  PERF_COUNT_HW_INSTRUCTIONS,
+                                  PERF_COUNT_HW_CACHE_MISSES};
+#define N_EVENTS (sizeof(events) / sizeof(events[0]))
+
+static int counting;
+static int warned;
+static double totals[n_perf_stages][PERF_N_FIELDS];
+
+/* Group leader of the thread: -2 not opened yet, -1 unavailable */
+static _Thread_local int leader = -2;
+
+static double now(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Counters of the calling thread only, user space, in one group */
+static int open_group(void) {
+  struct perf_event_attr attr;
+  int fd = -1;
+
+  for (size_t i = 0; i < N_EVENTS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = events[i];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int member = syscall(SYS_perf_event_open, &attr, 0, -1, fd, 0);
+    if (member < 0) {
+      int error = errno;
+#pragma omp critical(perf_warning)
+      if (!warned) {
+        warned = 1;
+        fprintf(stderr,
+                "Hardware counters unavailable (%s), only times are "
+                "reported\n",
+                strerror(error));
+      }
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    if (fd < 0)
+      fd = member;
+  }
+  return fd;
+}
+
+/* Counts scaled by the share of the time the group was scheduled */
+static int read_group(long long *values) {
+  uint64_t buf[3 + N_EVENTS];
+
+  if (read(leader, buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+    return 0;
+  for (size_t i = 0; i < N_EVENTS; i++)
+    values[i] = (long long)((double)buf[3 + i] * buf[1] / buf[2]);
+  return 1;
+}
+
+void perf_start(void) { counting = 1; }
+
+void perf_begin(perf_sample *s) {
+  long long values[N_EVENTS];
+
+  if (!counting)
+    return;
+  if (leader == -2)
+    leader = open_group();
+
+  s->counted = leader >= 0 && read_group(values);
+  if (s->counted) {
+    s->cycles = values[0];
+    s->instructions = values[1];
+    s->misses = values[2];
+  }
+  s->time = now();
+}
+
+void perf_end(const perf_sample *s, enum perf_stage stage, long n_pixels) {
+  long long values[N_EVENTS];
+  double *t = totals[stage];
+  double seconds;
+
+  if (!counting)
+    return;
+  seconds = now() - s->time;
+
+#pragma omp atomic
+  t[field_seconds] += seconds;
+#pragma omp atomic
+  t[field_pixels] += n_pixels;
+
+  if (!s->counted || !read_group(values))
+    return;
+#pragma omp atomic
+  t[field_counted_seconds] += seconds;
+#pragma omp atomic
+  t[field_counted_pixels] += n_pixels;
+#pragma omp atomic
+  t[field_cycles] += values[0] - s->cycles;
+#pragma omp atomic
+  t[field_instructions] += values[1] - s->instructions;
+#pragma omp atomic
+  t[field_misses] += values[2] - s->misses;
+}
+
+void perf_totals(double *out) {
+  memcpy(out, totals, sizeof(totals));
+}
+
+void perf_report(FILE *f, const char *label, const double *sums) {
+  for (int s = 0; s < n_perf_stages; s++) {
+    const double *t = sums + s * PERF_N_FIELDS;
+    double ipc = -1, misses = -1, bandwidth = -1;
+
+    if (t[field_pixels] == 0)
+      continue;
+    if (t[field_cycles] > 0) {
+      ipc = t[field_instructions] / t[field_cycles];
+      misses = t[field_misses] / t[field_counted_pixels];
+      // every miss brings one cache line
+      bandwidth = t[field_misses] * 64 / t[field_counted_seconds] / 1e9;
+    }
+    fprintf(f, "%s; %s; %lf; %.0lf; %.3lf; %.4lf; %.3lf\n", label,
+            stage_names[s], t[field_seconds], t[field_pixels], ipc, misses,
+            bandwidth);
+  }
+}
@@ -0,0 +1,121 @@
+#include "pipes.h"
+#include "filters.h"
+#include "omp_utils.h"
+#include "perf_utils.h"
+#include "trace_utils.h"
+
+#include <omp.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#define SOBELF_DEBUG 0
+
+void omp_pipe(img *image, const filter_params *params) {
+  const long n_pixels = (long)image->width * image->height;
+  perf_sample s;
+  double t;
+
+#if SOBELF_DEBUG
+  printf("Available threads in pipe: %d \n", omp_get_max_threads());
+#endif
+
+  t = trace_now();
+  perf_begin(&s);
+  omp_apply_gray_filter(image);
+  perf_end(&s, perf_gray, n_pixels);
+  trace_span("gray", image->id, t);
+
+  /* Apply blur filter with convergence value */
+  t = trace_now();
+  perf_begin(&s);
+  omp_apply_blur_filter(image, params->blur_size, params->blur_threshold);
+  perf_end(&s, perf_blur, n_pixels);
+  trace_span("blur", image->id, t);
+
+  /* Apply sobel filter on pixels */
+  t = trace_now();
+  perf_begin(&s);
+  omp_apply_sobel_filter(image, params->sobel_threshold);
+  perf_end(&s, perf_sobel, n_pixels);
+  trace_span("sobel", image->id, t);
+}
+
+void opt_pipe(img *image, const filter_params *params) {
+  const long n_pixels = (long)image->width * image->height;
+  perf_sample s;
+  double t;
+
+  /* Convert the pixels into grayscale */
+  t = trace_now();
+  perf_begin(&s);
+  apply_gray_filter_once(image);
+  perf_end(&s, perf_gray, n_pixels);
+  trace_span("gray", image->id, t);
+
+  /* Apply blur filter with convergence value */
+  t = trace_now();
+  perf_begin(&s);
+  apply_blur_filter_once_opt(image, params->blur_size, params->blur_threshold);
+  perf_end(&s, perf_blur, n_pixels);
+  trace_span("blur", image->id, t);
+
+  /* Apply sobel filter on pixels */
+  t = trace_now();
+  perf_begin(&s);
+  apply_sobel_filter_once_opt(image, params->sobel_threshold);
+  perf_end(&s, perf_sobel, n_pixels);
+  trace_span("sobel", image->id, t);
+}
+
+void default_pipe(img *image, const filter_params *params) {
+  const long n_pixels = (long)image->width * image->height;
+  perf_sample s;
+  double t;
+
+  /* Convert the pixels into grayscale */
+  t = trace_now();
+  perf_begin(&s);
+  apply_gray_filter_once(image);
+  perf_end(&s, perf_gray, n_pixels);
+  trace_span("gray", image->id, t);
+
+  /* Apply blur filter with convergence value */
+  t = trace_now();
+  perf_begin(&s);
+  apply_blur_filter_once(image, params->blur_size, params->blur_threshold);
+  perf_end(&s, perf_blur, n_pixels);
+  trace_span("blur", image->id, t);
+
+  /* Apply sobel filter on pixels */
+  t = trace_now();
+  perf_begin(&s);
+  apply_sobel_filter_once(image, params->sobel_threshold);
+  perf_end(&s, perf_sobel, n_pixels);
+  trace_span("sobel", image->id, t);
+}
+
+void log_pipe(img *image, const filter_params *params) {
+  struct timeval t1, t2;
+  double duration;
+
+  gettimeofday(&t1, NULL);
+  /* Convert the pixels into grayscale */
+  apply_gray_filter_once(image);
+  gettimeofday(&t2, NULL);
+  duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
+  printf("gray done in %lf\n", duration);
+
+  /* Apply blur filter with convergence value */
+  gettimeofday(&t1, NULL);
+  apply_blur_filter_once(image, params->blur_size, params->blur_threshold);
+  gettimeofday(&t2, NULL);
+  duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
+  printf("blur done in %lf\n", duration);
+
+  /* Apply sobel filter on pixels */
+  gettimeofday(&t1, NULL);
+  apply_sobel_filter_once(image, params->sobel_threshold);
+  gettimeofday(&t2, NULL);
+  duration = (t2.tv_sec - t1.tv_sec) + ((t2.tv_usec - t1.tv_usec) / 1e6);
+  printf("soble done in %lf\n", duration);
+}
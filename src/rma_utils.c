@@ -0,0 +1,197 @@
+#include <limits.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "gif_frames.h"
+#include "mem_utils.h"
+#include "omp_utils.h"
+#include "rma_utils.h"
+#include "trace_utils.h"
+
+/*
+ * Window of the root: the index of the next frame to claim, then the
+ * frames, each on MEM_ALIGN bytes. The other ranks expose nothing.
+ * */
+typedef struct {
+  MPI_Win win;
+  char *base;          /* root only */
+  MPI_Aint *offset;    /* of each frame in the window of the root */
+  int root;
+  int n_images;
+  int n_slots;         /* threads claiming frames over all the ranks */
+  unsigned char *mine; /* root only: frames filtered in place by the root */
+} rma_frames;
+
+static MPI_Aint rma_align(MPI_Aint size) {
+  return (size + MEM_ALIGN - 1) & ~(MPI_Aint)(MEM_ALIGN - 1);
+}
+
+/*
+ * Filter a frame of another rank: read it from the window, or decode it,
+ * and write the result back at the same place.
+ * */
+static void rma_frame(const rma_frames *rf, const img *frame, pipe_fn pipe,
+                      const filter_params *params, const gif_frames *frames) {
+  size_t n = (size_t)frame->width * frame->height;
+  img image = {frame->width, frame->height, frame->id,
+               mem_alloc(sizeof(pixel) * n)};
+  MPI_Request request;
+
+  if (frames != NULL) {
+    if (!gif_frames_decode(frames, image.id, image.p))
+      memset(image.p, 0, sizeof(pixel) * n);
+  } else {
+    double t = trace_now();
+    MPI_Rget(image.p, 3 * n, MPI_INT, rf->root, rf->offset[image.id], 3 * n,
+             MPI_INT, rf->win, &request);
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+    trace_span("get", image.id, t);
+  }
+
+  pipe(&image, params);
+
+  // only local completion, the flush before the final barrier does the rest
+  double t = trace_now();
+  MPI_Rput(image.p, 3 * n, MPI_INT, rf->root, rf->offset[image.id], 3 * n,
+           MPI_INT, rf->win, &request);
+  MPI_Wait(&request, MPI_STATUS_IGNORE);
+  trace_span("put", image.id, t);
+  free(image.p);
+}
+
+/*
+ * One claiming thread: take the next frames off the counter of the root
+ * until it runs past the last one. Frames of the root are filtered in
+ * place, without going through the window.
+ * */
+static void rma_thread(rma_frames *rf, img *images, int is_root,
+                       pipe_fn pipe, const filter_params *params,
+                       const gif_frames *frames) {
+  int seen = 0;
+
+  for (;;) {
+    int k = (rf->n_images - seen) / (2 * rf->n_slots), first;
+
+    if (k < 1)
+      k = 1;
+    double t = trace_now();
+    MPI_Fetch_and_op(&k, &first, MPI_INT, rf->root, 0, MPI_SUM, rf->win);
+    MPI_Win_flush(rf->root, rf->win);
+    trace_span("claim", -1, t);
+    if (first >= rf->n_images)
+      break;
+    seen = first + k;
+
+    for (int i = first; i < seen && i < rf->n_images; i++) {
+      if (!is_root) {
+        rma_frame(rf, images + i, pipe, params, frames);
+        continue;
+      }
+      if (frames != NULL && !gif_frames_decode(frames, i, images[i].p))
+        memset(images[i].p, 0,
+               sizeof(pixel) * images[i].width * images[i].height);
+      pipe(images + i, params);
+      rf->mine[i] = 1;
+    }
+  }
+}
+
+typedef struct {
+  rma_frames *rf;
+  img *images;
+  int is_root;
+  pipe_fn pipe;
+  const filter_params *params;
+  const gif_frames *frames;
+} rma_args;
+
+static void rma_team(void *arg) {
+  const rma_args *r = arg;
+
+  rma_thread(r->rf, r->images, r->is_root, r->pipe, r->params, r->frames);
+}
+
+void rma_filter(int n_threads, int n_images, img *images, int root,
+                pipe_fn pipe, const filter_params *params,
+                const gif_frames *frames) {
+  rma_frames rf = {0};
+  MPI_Aint size = rma_align(sizeof(int));
+  int rank, slots;
+  int claims, alone = 0;
+  void *base;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  rf.root = root;
+  rf.n_images = n_images;
+  rf.offset = malloc(sizeof(MPI_Aint) * (n_images + 1));
+  for (int i = 0; i < n_images; i++) {
+    rf.offset[i] = size;
+    size += rma_align(sizeof(pixel) * images[i].width * images[i].height);
+    if (3 * (size_t)images[i].width * images[i].height > INT_MAX)
+      alone = 1;
+  }
+
+  // MPI counts are ints: every rank sees the overflow, the root filters all
+  if (alone && rank == root)
+    fprintf(stderr, "Frames too large to get, filtering on the root\n");
+
+  // a root without pipe only holds a counter that is already past the end
+  claims = rank == root ? pipe != NULL : !alone;
+  slots = claims ? n_threads : 0;
+  MPI_Allreduce(&slots, &rf.n_slots, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  if (rf.n_slots < 1)
+    rf.n_slots = 1;
+
+  if (rank != root)
+    size = 0;
+  else if (pipe == NULL || alone)
+    size = sizeof(int);
+  MPI_Win_allocate(size, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &base, &rf.win);
+
+  if (rank == root) {
+    rf.base = base;
+    rf.mine = calloc(n_images + 1, 1);
+    *(int *)rf.base = pipe != NULL ? 0 : n_images;
+    // decoding ranks do not read the frames from the window
+    if (pipe != NULL && frames == NULL && !alone) {
+#pragma omp parallel for schedule(dynamic)
+      for (int i = 0; i < n_images; i++)
+        memcpy(rf.base + rf.offset[i], images[i].p,
+               sizeof(pixel) * images[i].width * images[i].height);
+    }
+  }
+
+  /* Passive epoch for the whole run, the barriers order the accesses */
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, rf.win);
+  if (rank == root)
+    MPI_Win_sync(rf.win);
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  if (claims) {
+    rma_args r = {&rf, images, rank == root, pipe, params, frames};
+    omp_run_team(n_threads, rma_team, &r);
+  }
+
+  // every result is in the window of the root once past the barrier
+  double t = trace_now();
+  MPI_Win_flush_all(rf.win);
+  MPI_Barrier(MPI_COMM_WORLD);
+  trace_span("wait", -1, t);
+
+  if (rank == root && pipe != NULL) {
+    MPI_Win_sync(rf.win);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n_images; i++)
+      if (!rf.mine[i])
+        memcpy(images[i].p, rf.base + rf.offset[i],
+               sizeof(pixel) * images[i].width * images[i].height);
+  }
+
+  MPI_Win_unlock_all(rf.win);
+  MPI_Win_free(&rf.win);
+  free(rf.offset);
+  free(rf.mine);
+}
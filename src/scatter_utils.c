@@ -0,0 +1,204 @@
+#include <limits.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "gif_frames.h"
+#include "mem_utils.h"
+#include "omp_utils.h"
+#include "scatter_utils.h"
+#include "trace_utils.h"
+
+/*
+ * First frame of each rank, first[size] being n_images. A frame goes to
+ * the rank whose share of the pixels, proportional to its threads, holds
+ * the middle of the frame.
+ * */
+static void scatter_split(int n_images, const img *images,
+                          const int *threads, int size, int *first) {
+  double total = 0, weight = 0, before = 0, share = 0;
+  int r = 0;
+
+  for (int i = 0; i < n_images; i++)
+    total += (double)images[i].width * images[i].height;
+  for (int q = 0; q < size; q++)
+    weight += threads[q];
+
+  first[0] = 0;
+  for (int i = 0; i < n_images; i++) {
+    double n = (double)images[i].width * images[i].height;
+
+    while (r < size - 1 &&
+           (before + n / 2) * weight >= total * (share + threads[r])) {
+      share += threads[r];
+      first[++r] = i;
+    }
+    before += n;
+  }
+  while (r < size)
+    first[++r] = n_images;
+}
+
+/*
+ * Pixels of each rank in the buffer of the root, which holds the frames of
+ * every other rank in order, and the offset of each frame in it. Returns
+ * the size of the buffer in pixels.
+ * */
+static long long scatter_layout(const img *images, const int *first,
+                                int size, int root, int *counts, int *displs,
+                                long long *at) {
+  long long packed = 0;
+
+  for (int r = 0; r < size; r++) {
+    long long start = packed;
+
+    for (int i = first[r]; i < first[r + 1]; i++) {
+      at[i] = packed;
+      if (r != root)
+        packed += (long long)images[i].width * images[i].height;
+    }
+    counts[r] = packed - start;
+    displs[r] = start;
+  }
+  return packed;
+}
+
+/*
+ * Filter frame i, in place in images on the root, or in its slot of the
+ * buffer received by the other ranks.
+ * */
+static void scatter_frame(img *images, int i, pixel *slot, pipe_fn pipe,
+                          const filter_params *params,
+                          const gif_frames *frames) {
+  size_t n = (size_t)images[i].width * images[i].height;
+  img image = {images[i].width, images[i].height, i, NULL};
+
+  if (slot == NULL) {
+    if (frames != NULL && !gif_frames_decode(frames, i, images[i].p))
+      memset(images[i].p, 0, sizeof(pixel) * n);
+    pipe(images + i, params);
+    return;
+  }
+
+  // the pipes swap their buffers, the slot cannot be filtered in place
+  image.p = mem_alloc(sizeof(pixel) * n);
+  if (frames == NULL)
+    memcpy(image.p, slot, sizeof(pixel) * n);
+  else if (!gif_frames_decode(frames, i, image.p))
+    memset(image.p, 0, sizeof(pixel) * n);
+  pipe(&image, params);
+  memcpy(slot, image.p, sizeof(pixel) * n);
+  free(image.p);
+}
+
+typedef struct {
+  img *images;
+  int a, b;
+  int is_root;
+  pixel *buf;
+  long long base;
+  const long long *at;
+  pipe_fn pipe;
+  const filter_params *params;
+  const gif_frames *frames;
+} scatter_args;
+
+/* Frames a..b-1 of this rank, shared by the team if there is one */
+static void scatter_team(void *arg) {
+  const scatter_args *s = arg;
+
+#pragma omp for schedule(dynamic)
+  for (int i = s->a; i < s->b; i++) {
+    pixel *slot = !s->is_root ? s->buf + (s->at[i] - s->base) : NULL;
+    scatter_frame(s->images, i, slot, s->pipe, s->params, s->frames);
+  }
+}
+
+void scatter_filter(int n_threads, int n_images, img *images, int root,
+                    pipe_fn pipe, const filter_params *params,
+                    const gif_frames *frames) {
+  int rank, size, go = pipe != NULL;
+  int *threads, *first, *counts, *displs;
+  long long *at, packed;
+  pixel *buf = NULL;
+  MPI_Datatype pixel_type;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  MPI_Bcast(&go, 1, MPI_INT, root, MPI_COMM_WORLD);
+  if (!go)
+    return;
+
+  threads = malloc(sizeof(int) * size);
+  first = malloc(sizeof(int) * (size + 1));
+  counts = malloc(sizeof(int) * size);
+  displs = malloc(sizeof(int) * size);
+  at = malloc(sizeof(long long) * (n_images + 1));
+
+  MPI_Allgather(&n_threads, 1, MPI_INT, threads, 1, MPI_INT, MPI_COMM_WORLD);
+  scatter_split(n_images, images, threads, size, first);
+  packed = scatter_layout(images, first, size, root, counts, displs, at);
+
+  // MPI counts are ints: every rank sees the overflow, the root filters all
+  if (packed > INT_MAX) {
+    if (rank == root)
+      fprintf(stderr, "Too many pixels to scatter, filtering on the root\n");
+    for (int r = 0; r <= size; r++)
+      first[r] = r <= root ? 0 : n_images;
+    packed = scatter_layout(images, first, size, root, counts, displs, at);
+  }
+
+  MPI_Type_contiguous(3, MPI_INT, &pixel_type);
+  MPI_Type_commit(&pixel_type);
+
+  double t = trace_now();
+  if (rank == root) {
+    buf = packed > 0 ? mem_alloc(sizeof(pixel) * packed) : NULL;
+    // ranks holding the compressed GIF decode their frames themselves
+    if (frames == NULL) {
+#pragma omp parallel for schedule(dynamic)
+      for (int i = 0; i < n_images; i++)
+        if (i < first[root] || i >= first[root + 1])
+          memcpy(buf + at[i], images[i].p,
+                 sizeof(pixel) * images[i].width * images[i].height);
+      MPI_Scatterv(buf, counts, displs, pixel_type, MPI_IN_PLACE, 0,
+                   pixel_type, root, MPI_COMM_WORLD);
+    }
+  } else {
+    buf = counts[rank] > 0 ? mem_alloc(sizeof(pixel) * counts[rank]) : NULL;
+    if (frames == NULL)
+      MPI_Scatterv(NULL, NULL, NULL, pixel_type, buf, counts[rank],
+                   pixel_type, root, MPI_COMM_WORLD);
+  }
+  trace_span("scatter", -1, t);
+
+  scatter_args sa = {images, first[rank], first[rank + 1], rank == root,
+                     buf, rank == root ? 0 : displs[rank], at, pipe,
+                     params, frames};
+  omp_run_team(n_threads, scatter_team, &sa);
+
+  t = trace_now();
+  if (rank == root) {
+    MPI_Gatherv(MPI_IN_PLACE, 0, pixel_type, buf, counts, displs, pixel_type,
+                root, MPI_COMM_WORLD);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n_images; i++)
+      if (i < first[root] || i >= first[root + 1])
+        memcpy(images[i].p, buf + at[i],
+               sizeof(pixel) * images[i].width * images[i].height);
+  } else {
+    MPI_Gatherv(buf, counts[rank], pixel_type, NULL, NULL, NULL, pixel_type,
+                root, MPI_COMM_WORLD);
+  }
+  trace_span("gather", -1, t);
+
+  MPI_Type_free(&pixel_type);
+  free(buf);
+  free(threads);
+  free(first);
+  free(counts);
+  free(displs);
+  free(at);
+}
@@ -0,0 +1,384 @@
+#include "simd_filters.h"
+#include "blur_kernels.h"
+#include "mem_utils.h"
+#include "perf_utils.h"
+#include "pipes.h"
+#include "trace_utils.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+#define SOBELF_DEBUG 0
+
+/*
+ * After the gray filter the three channels are equal, so the blur and the
+ * sobel filter run on one 16-bit gray plane. The blur first sums the
+ * 2 * size + 1 rows of the stencil per column, then the 2 * size + 1
+ * neighbouring column sums per pixel, 8 or 16 pixels at a time.
+ */
+typedef struct {
+  int size;
+  int threshold; /* clamped to [-1, 255], so it fits a signed 16-bit lane */
+  uint16_t mul;  /* x / area == (x * mul) >> (16 + shift) */
+  int shift;
+} simd_blur;
+
+/*
+ * Blur row j of p into new from the column sums of the row and return 1 if
+ * any pixel moved by more than the threshold. Once a change is seen the
+ * remaining pixels of the row skip the test.
+ * */
+typedef int (*simd_row_fn)(const simd_blur *blur, const uint16_t *p,
+                           uint16_t *new, uint16_t *sums, int j, int width);
+
+/*
+ * Find the reciprocal of the area for mulhi: the smallest shift such that
+ * (x * ceil(2^(16 + shift) / area)) >> (16 + shift) == x / area for every
+ * sum x the blur can produce. The candidate is checked exhaustively.
+ * */
+static int find_blur_divisor(simd_blur *blur) {
+  const uint32_t area = (2 * blur->size + 1) * (2 * blur->size + 1);
+  const uint32_t max_sum = area * 255;
+
+  for (int shift = 0; shift < 16; shift++) {
+    uint32_t mul = ((1u << (16 + shift)) + area - 1) / area;
+    uint32_t x;
+
+    if (mul > UINT16_MAX)
+      return 0;
+    for (x = 0; x <= max_sum; x++)
+      if ((x * mul) >> (16 + shift) != x / area)
+        break;
+    if (x > max_sum) {
+      blur->mul = mul;
+      blur->shift = shift;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Divisors of each radius, found once: 0 not yet, 1 found, -1 none */
+static int divisor_state[SIMD_BLUR_MAX_SIZE + 1];
+static simd_blur divisors[SIMD_BLUR_MAX_SIZE + 1];
+
+/* Set the reciprocal of blur->size, in 1..SIMD_BLUR_MAX_SIZE, if it has one */
+static int simd_blur_divisor(simd_blur *blur) {
+  int state;
+
+#pragma omp critical(simd_setup)
+  {
+    if (divisor_state[blur->size] == 0) {
+      divisors[blur->size].size = blur->size;
+      divisor_state[blur->size] =
+          find_blur_divisor(&divisors[blur->size]) ? 1 : -1;
+    }
+    state = divisor_state[blur->size];
+  }
+  if (state < 0)
+    return 0;
+  blur->mul = divisors[blur->size].mul;
+  blur->shift = divisors[blur->size].shift;
+  return 1;
+}
+
+/* Vertical sums of the stencil rows for columns x to width - 1 */
+static void column_sums(const uint16_t *p, uint16_t *sums, int j, int x,
+                        int width, int size) {
+  for (; x < width; x++) {
+    uint16_t s = 0;
+    for (int stencil_j = -size; stencil_j <= size; stencil_j++)
+      s += p[CONV(j + stencil_j, x, width)];
+    sums[x] = s;
+  }
+}
+
+/* Blur columns k to end - 1 of a row from its column sums */
+static int blur_columns(const simd_blur *blur, const uint16_t *sums,
+                        const uint16_t *o, uint16_t *n, int k, int end,
+                        int changed) {
+  const int size = blur->size;
+
+  for (; k < end; k++) {
+    uint32_t t = 0;
+    for (int stencil_k = -size; stencil_k <= size; stencil_k++)
+      t += sums[k + stencil_k];
+
+    n[k] = (t * blur->mul) >> (16 + blur->shift);
+    changed |= abs(n[k] - o[k]) > blur->threshold;
+  }
+  return changed;
+}
+
+static int blur_row_scalar(const simd_blur *blur, const uint16_t *p,
+                           uint16_t *new, uint16_t *sums, int j, int width) {
+  column_sums(p, sums, j, 0, width, blur->size);
+  return blur_columns(blur, sums, p + CONV(j, 0, width),
+                      new + CONV(j, 0, width), blur->size, width - blur->size,
+                      0);
+}
+
+#if SIMD_X86
+__attribute__((target("sse2"))) static int
+blur_row_sse2(const simd_blur *blur, const uint16_t *p, uint16_t *new,
+              uint16_t *sums, int j, int width) {
+  const int size = blur->size;
+  const uint16_t *o = p + CONV(j, 0, width);
+  uint16_t *n = new + CONV(j, 0, width);
+  const __m128i mul = _mm_set1_epi16(blur->mul);
+  const __m128i shift = _mm_cvtsi32_si128(blur->shift);
+  const __m128i threshold = _mm_set1_epi16(blur->threshold);
+  int changed = 0;
+  int x, k;
+
+  for (x = 0; x + 8 <= width; x += 8) {
+    __m128i s = _mm_setzero_si128();
+    for (int stencil_j = -size; stencil_j <= size; stencil_j++)
+      s = _mm_add_epi16(
+          s, _mm_loadu_si128((const __m128i *)(p + CONV(j + stencil_j, x,
+                                                        width))));
+    _mm_storeu_si128((__m128i *)(sums + x), s);
+  }
+  column_sums(p, sums, j, x, width, size);
+
+  for (k = size; k + 8 <= width - size; k += 8) {
+    __m128i t = _mm_loadu_si128((const __m128i *)(sums + k - size));
+    for (int stencil_k = -size + 1; stencil_k <= size; stencil_k++)
+      t = _mm_add_epi16(
+          t, _mm_loadu_si128((const __m128i *)(sums + k + stencil_k)));
+
+    __m128i q = _mm_srl_epi16(_mm_mulhi_epu16(t, mul), shift);
+    _mm_storeu_si128((__m128i *)(n + k), q);
+
+    if (!changed) {
+      __m128i old = _mm_loadu_si128((const __m128i *)(o + k));
+      __m128i d =
+          _mm_or_si128(_mm_subs_epu16(q, old), _mm_subs_epu16(old, q));
+      changed = _mm_movemask_epi8(_mm_cmpgt_epi16(d, threshold)) != 0;
+    }
+  }
+  return blur_columns(blur, sums, o, n, k, width - size, changed);
+}
+
+__attribute__((target("avx2"))) static int
+blur_row_avx2(const simd_blur *blur, const uint16_t *p, uint16_t *new,
+              uint16_t *sums, int j, int width) {
+  const int size = blur->size;
+  const uint16_t *o = p + CONV(j, 0, width);
+  uint16_t *n = new + CONV(j, 0, width);
+  const __m256i mul = _mm256_set1_epi16(blur->mul);
+  const __m128i shift = _mm_cvtsi32_si128(blur->shift);
+  const __m256i threshold = _mm256_set1_epi16(blur->threshold);
+  int changed = 0;
+  int x, k;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    __m256i s = _mm256_setzero_si256();
+    for (int stencil_j = -size; stencil_j <= size; stencil_j++)
+      s = _mm256_add_epi16(
+          s, _mm256_loadu_si256(
+                 (const __m256i *)(p + CONV(j + stencil_j, x, width))));
+    _mm256_storeu_si256((__m256i *)(sums + x), s);
+  }
+  column_sums(p, sums, j, x, width, size);
+
+  for (k = size; k + 16 <= width - size; k += 16) {
+    __m256i t = _mm256_loadu_si256((const __m256i *)(sums + k - size));
+    for (int stencil_k = -size + 1; stencil_k <= size; stencil_k++)
+      t = _mm256_add_epi16(
+          t, _mm256_loadu_si256((const __m256i *)(sums + k + stencil_k)));
+
+    __m256i q = _mm256_srl_epi16(_mm256_mulhi_epu16(t, mul), shift);
+    _mm256_storeu_si256((__m256i *)(n + k), q);
+
+    if (!changed) {
+      __m256i old = _mm256_loadu_si256((const __m256i *)(o + k));
+      __m256i d = _mm256_or_si256(_mm256_subs_epu16(q, old),
+                                  _mm256_subs_epu16(old, q));
+      changed = _mm256_movemask_epi8(_mm256_cmpgt_epi16(d, threshold)) != 0;
+    }
+  }
+  return blur_columns(blur, sums, o, n, k, width - size, changed);
+}
+#endif
+
+/*
+ * Widest kernel the CPU supports. SOBELF_SIMD=avx2|sse2|scalar caps the
+ * choice, to compare the paths on the same machine.
+ * */
+static simd_row_fn detect_row(const char **name) {
+  const char *cap = getenv("SOBELF_SIMD");
+
+#if SIMD_X86
+  __builtin_cpu_init();
+  if ((cap == NULL || !strcmp(cap, "avx2")) &&
+      __builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return blur_row_avx2;
+  }
+  if ((cap == NULL || strcmp(cap, "scalar")) &&
+      __builtin_cpu_supports("sse2")) {
+    *name = "sse2";
+    return blur_row_sse2;
+  }
+#endif
+  (void)cap;
+  *name = "scalar";
+  return blur_row_scalar;
+}
+
+/* The kernel of detect_row, picked on first use */
+static simd_row_fn select_row(const char **name) {
+  static simd_row_fn row;
+  static const char *row_name;
+  simd_row_fn selected;
+
+#pragma omp critical(simd_setup)
+  {
+    if (row == NULL)
+      row = detect_row(&row_name);
+    selected = row;
+    *name = row_name;
+  }
+  return selected;
+}
+
+const char *simd_kernel_name(void) {
+  const char *name;
+  select_row(&name);
+  return name;
+}
+
+/* Returns the plane holding the blurred frame, either plane or tmp */
+static uint16_t *blur_plane(uint16_t *plane, uint16_t *tmp, uint16_t *sums,
+                            int width, int height, const simd_blur *blur,
+                            int threshold, int id) {
+  const char *name;
+  simd_row_fn row = select_row(&name);
+  uint16_t *p = plane;
+  uint16_t *new = tmp;
+  int end = 0;
+  int n_iter = 0;
+
+  memcpy(new, p, (size_t)width * height * sizeof(uint16_t));
+
+  do {
+    double t = trace_now();
+    end = 1;
+    n_iter++;
+
+    /* Apply blur on top AND bottom part of image (10%) */
+    for (int j = blur->size; j < height / 10 - blur->size; j++) {
+      if (row(blur, p, new, sums, j, width))
+        end = 0;
+      if (row(blur, p, new, sums, height - j - 1, width))
+        end = 0;
+    }
+
+    uint16_t *swap = p;
+    p = new;
+    new = swap;
+    trace_span("blur iteration", id, t);
+  } while (threshold > 0 && !end);
+
+#if SOBELF_DEBUG
+  printf("BLUR (%s): number of iterations for image %d\n", name, n_iter);
+#endif
+
+  return p;
+}
+
+void simd_pipe(img *image, const filter_params *params) {
+  const int width = image->width;
+  const int height = image->height;
+  const size_t n_pixels = (size_t)width * height;
+  const int limit = sobel_limit(params->sobel_threshold);
+  simd_blur blur;
+  pixel *p = image->p;
+
+  blur.size = params->blur_size;
+  blur.threshold = params->blur_threshold;
+  if (blur.threshold < -1)
+    blur.threshold = -1;
+  if (blur.threshold > 255)
+    blur.threshold = 255;
+
+  if (blur.size < 1 || blur.size > SIMD_BLUR_MAX_SIZE ||
+      !simd_blur_divisor(&blur)) {
+    opt_pipe(image, params);
+    return;
+  }
+
+  uint16_t *plane = mem_alloc(2 * n_pixels * sizeof(uint16_t));
+  uint16_t *sums = malloc(width * sizeof(uint16_t));
+  if (plane == NULL || sums == NULL) {
+    fprintf(stderr, "Unable to allocate the gray planes\n");
+    free(plane);
+    free(sums);
+    opt_pipe(image, params);
+    return;
+  }
+
+  /* Convert the pixels into grayscale */
+  double t = trace_now();
+  perf_sample s;
+  perf_begin(&s);
+  for (size_t i = 0; i < n_pixels; i++) {
+    int moy = (p[i].r + p[i].g + p[i].b) / 3;
+    plane[i] = moy < 0 ? 0 : moy > 255 ? 255 : moy;
+  }
+  perf_end(&s, perf_gray, n_pixels);
+  trace_span("gray", image->id, t);
+
+  /* Apply blur filter with convergence value */
+  t = trace_now();
+  perf_begin(&s);
+  uint16_t *g = blur_plane(plane, plane + n_pixels, sums, width, height, &blur,
+                           params->blur_threshold, image->id);
+  perf_end(&s, perf_blur, n_pixels);
+  trace_span("blur", image->id, t);
+
+  /* Apply sobel filter, the borders keep their blurred value */
+  t = trace_now();
+  perf_begin(&s);
+  for (int j = 0; j < height; j++) {
+    for (int k = 0; k < width; k++) {
+      int v = g[CONV(j, k, width)];
+
+      if (j > 0 && j < height - 1 && k > 0 && k < width - 1) {
+        int deltaX = -g[CONV(j - 1, k - 1, width)] +
+                     g[CONV(j - 1, k + 1, width)] -
+                     2 * g[CONV(j, k - 1, width)] +
+                     2 * g[CONV(j, k + 1, width)] -
+                     g[CONV(j + 1, k - 1, width)] +
+                     g[CONV(j + 1, k + 1, width)];
+        int deltaY = g[CONV(j + 1, k + 1, width)] +
+                     2 * g[CONV(j + 1, k, width)] +
+                     g[CONV(j + 1, k - 1, width)] -
+                     g[CONV(j - 1, k + 1, width)] -
+                     2 * g[CONV(j - 1, k, width)] -
+                     g[CONV(j - 1, k - 1, width)];
+        v = (deltaX * deltaX + deltaY * deltaY > limit) * 255;
+      }
+
+      p[CONV(j, k, width)].r = v;
+      p[CONV(j, k, width)].g = v;
+      p[CONV(j, k, width)].b = v;
+    }
+  }
+  perf_end(&s, perf_sobel, n_pixels);
+  trace_span("sobel", image->id, t);
+
+  free(plane);
+  free(sums);
+}
@@ -0,0 +1,252 @@
+/*
+ * INF560
+ *
+ * libsobelf: in-memory library interface, see include/sobelf.h
+ */
+#include <omp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gif_mem.h"
+#include "pipes.h"
+#include "simd_filters.h"
+#include "sobelf.h"
+#include "utils.h"
+
+struct sobelf_ctx {
+  sobelf_options options;
+  pipe_fn pipe;
+  filter_params params;
+  pixel **pool;     /* Free frame buffers */
+  size_t *pool_pixels; /* Capacity in pixels of each of them */
+  int pool_count;
+  char error[256];
+};
+
+static int fail(sobelf_ctx *ctx, const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(ctx->error, sizeof(ctx->error), format, args);
+  va_end(args);
+  return -1;
+}
+
+/* Smallest pooled buffer holding n_pixels, or a new one */
+static pixel *pool_get(size_t n_pixels, void *arg) {
+  sobelf_ctx *ctx = arg;
+  int best = -1;
+
+  for (int i = 0; i < ctx->pool_count; i++)
+    if (ctx->pool_pixels[i] >= n_pixels &&
+        (best < 0 || ctx->pool_pixels[i] < ctx->pool_pixels[best]))
+      best = i;
+
+  if (best < 0)
+    return malloc(n_pixels * sizeof(pixel));
+
+  pixel *p = ctx->pool[best];
+  ctx->pool_count--;
+  ctx->pool[best] = ctx->pool[ctx->pool_count];
+  ctx->pool_pixels[best] = ctx->pool_pixels[ctx->pool_count];
+  return p;
+}
+
+/* Keep the largest buffers up to pool_size, release the others */
+static void pool_put(sobelf_ctx *ctx, pixel *p, size_t n_pixels) {
+  int smallest = 0;
+
+  if (ctx->pool_count < ctx->options.pool_size) {
+    ctx->pool[ctx->pool_count] = p;
+    ctx->pool_pixels[ctx->pool_count] = n_pixels;
+    ctx->pool_count++;
+    return;
+  }
+
+  for (int i = 1; i < ctx->pool_count; i++)
+    if (ctx->pool_pixels[i] < ctx->pool_pixels[smallest])
+      smallest = i;
+
+  if (ctx->pool_count == 0 || ctx->pool_pixels[smallest] >= n_pixels) {
+    free(p);
+    return;
+  }
+  free(ctx->pool[smallest]);
+  ctx->pool[smallest] = p;
+  ctx->pool_pixels[smallest] = n_pixels;
+}
+
+sobelf_options sobelf_default_options(void) {
+  filter_params params = FILTER_PARAMS_DEFAULT;
+  sobelf_options options = {0,
+                            SOBELF_PROC_OPT,
+                            16,
+                            params.blur_size,
+                            params.blur_threshold,
+                            params.sobel_threshold,
+                            0};
+  return options;
+}
+
+sobelf_ctx *sobelf_create(const sobelf_options *options) {
+  sobelf_ctx *ctx = calloc(1, sizeof(sobelf_ctx));
+  if (ctx == NULL)
+    return NULL;
+
+  ctx->options = *options;
+  if (ctx->options.n_threads <= 0)
+    ctx->options.n_threads = omp_get_num_procs();
+  if (ctx->options.pool_size < 0)
+    ctx->options.pool_size = 0;
+
+  ctx->params.blur_size = ctx->options.blur_size;
+  ctx->params.blur_threshold = ctx->options.blur_threshold;
+  ctx->params.sobel_threshold = ctx->options.sobel_threshold;
+
+  switch (ctx->options.processor) {
+  case SOBELF_PROC_OPT:
+    ctx->pipe = opt_pipe;
+    break;
+  case SOBELF_PROC_OMP:
+    ctx->pipe = omp_pipe;
+    break;
+  case SOBELF_PROC_SIMD:
+    ctx->pipe = simd_pipe;
+    break;
+  default:
+    ctx->pipe = default_pipe;
+    break;
+  }
+
+  ctx->pool = malloc((ctx->options.pool_size + 1) * sizeof(pixel *));
+  ctx->pool_pixels = malloc((ctx->options.pool_size + 1) * sizeof(size_t));
+  if (ctx->pool == NULL || ctx->pool_pixels == NULL) {
+    sobelf_destroy(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void sobelf_destroy(sobelf_ctx *ctx) {
+  if (ctx == NULL)
+    return;
+  for (int i = 0; i < ctx->pool_count; i++)
+    free(ctx->pool[i]);
+  free(ctx->pool);
+  free(ctx->pool_pixels);
+  free(ctx);
+}
+
+/*
+ * The OMP processor spreads each frame over the threads, the sequential
+ * ones process several frames at once. omp_set_num_threads only affects
+ * the calling thread, so contexts do not interfere.
+ */
+static void run_pipe(sobelf_ctx *ctx, img *images, int n_images) {
+  if (ctx->options.processor == SOBELF_PROC_OMP) {
+    int saved = omp_get_max_threads();
+    omp_set_num_threads(ctx->options.n_threads);
+    for (int i = 0; i < n_images; i++)
+      ctx->pipe(images + i, &ctx->params);
+    omp_set_num_threads(saved);
+    return;
+  }
+
+#pragma omp parallel for num_threads(ctx->options.n_threads) schedule(dynamic)
+  for (int i = 0; i < n_images; i++)
+    ctx->pipe(images + i, &ctx->params);
+}
+
+int sobelf_process_gif(sobelf_ctx *ctx, const void *data, size_t size,
+                       void **out, size_t *out_size) {
+  gif_membuf in, output = {NULL, 0, 0, 0, -1, 0};
+  GifFileType *g;
+  animated_gif *image;
+  img *images;
+  int error;
+  int ok;
+
+  *out = NULL;
+  *out_size = 0;
+
+  g = gif_mem_open_read(&in, data, size, &error);
+  if (g == NULL)
+    return fail(ctx, "Error DGifOpen: %s", GifErrorString(error));
+
+  image = load_pixels_from_gif(g, pool_get, ctx);
+  if (image == NULL) {
+    DGifCloseFile(g, NULL);
+    return fail(ctx, "Unable to decode the GIF");
+  }
+
+  images = malloc(sizeof(img) * image->n_images);
+  if (images == NULL) {
+    free_pixels(image);
+    return fail(ctx, "Unable to allocate %d images", image->n_images);
+  }
+  for (int i = 0; i < image->n_images; i++) {
+    images[i].width = image->width[i];
+    images[i].height = image->height[i];
+    images[i].id = i;
+    images[i].p = image->p[i];
+  }
+
+  run_pipe(ctx, images, image->n_images);
+
+  for (int i = 0; i < image->n_images; i++)
+    image->p[i] = images[i].p;
+  free(images);
+
+  ok = store_pixels_mem(&output, image, ctx->options.frame_diff);
+
+  /* Hand the frame buffers back to the pool */
+  for (int i = 0; i < image->n_images; i++) {
+    pool_put(ctx, image->p[i], (size_t)image->width[i] * image->height[i]);
+    image->p[i] = NULL;
+  }
+  free_pixels(image);
+
+  if (!ok) {
+    free(output.data);
+    return fail(ctx, "Unable to encode the GIF");
+  }
+
+  *out = output.data;
+  *out_size = output.size;
+  return 0;
+}
+
+int sobelf_process_frame(sobelf_ctx *ctx, unsigned char *rgb, int width,
+                         int height) {
+  img image = {width, height, 0, NULL};
+  size_t n_pixels = (size_t)width * height;
+
+  if (width <= 0 || height <= 0)
+    return fail(ctx, "Invalid frame size %d x %d", width, height);
+
+  image.p = pool_get(n_pixels, ctx);
+  if (image.p == NULL)
+    return fail(ctx, "Unable to allocate %zu pixels", n_pixels);
+
+  for (size_t j = 0; j < n_pixels; j++) {
+    image.p[j].r = rgb[3 * j + 0];
+    image.p[j].g = rgb[3 * j + 1];
+    image.p[j].b = rgb[3 * j + 2];
+  }
+
+  run_pipe(ctx, &image, 1);
+
+  for (size_t j = 0; j < n_pixels; j++) {
+    rgb[3 * j + 0] = image.p[j].r;
+    rgb[3 * j + 1] = image.p[j].g;
+    rgb[3 * j + 2] = image.p[j].b;
+  }
+
+  pool_put(ctx, image.p, n_pixels);
+  return 0;
+}
+
+const char *sobelf_error(const sobelf_ctx *ctx) { return ctx->error; }
+
+void sobelf_free(void *out) { free(out); }
@@ -0,0 +1,140 @@
+/*
+ * INF560
+ *
+ * Minimal client for the sobelf daemon (sobelf --serve socket ...)
+ */
+#include <limits.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon_utils.h"
+
+/* Lines read from stdin, before their paths are made absolute */
+#define MAX_INPUT_LINE (3 * PATH_MAX)
+
+/* The daemon does not share our working directory, send absolute paths */
+static int absolute_path(const char *path, char *out, int must_exist) {
+  char dir[PATH_MAX], base[PATH_MAX], real_dir[PATH_MAX];
+
+  if (must_exist)
+    return realpath(path, out) != NULL;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  snprintf(base, sizeof(base), "%s", path);
+  if (realpath(dirname(dir), real_dir) == NULL)
+    return 0;
+  return snprintf(out, PATH_MAX, "%s/%s", real_dir, basename(base)) <
+         PATH_MAX;
+}
+
+static int connect_to(const char *socket_path) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(socket_path);
+    return -1;
+  }
+  return fd;
+}
+
+static int send_line(int fd, const char *line) {
+  size_t len = strlen(line);
+  return write(fd, line, len) == (ssize_t)len;
+}
+
+/* Print the answer to one request, returns 0 if it failed */
+static int read_answer(FILE *fanswer, const char *what) {
+  char answer[256];
+
+  if (fgets(answer, sizeof(answer), fanswer) == NULL) {
+    fprintf(stderr, "%s: connection closed\n", what);
+    return 0;
+  }
+  printf("%s: %s", what, answer);
+  return !strncmp(answer, "ok", 2);
+}
+
+/*
+ * Usage:
+ *   sobelf_client socket input.gif output.gif [producer processor]
+ *   sobelf_client socket -     (one request per line on stdin)
+ *   sobelf_client socket quit
+ */
+int main(int argc, char **argv) {
+  char request[MAX_INPUT_LINE];
+  char input[PATH_MAX], output[PATH_MAX];
+  FILE *fanswer;
+  int ok = 1;
+  int fd;
+
+  if (argc != 3 && argc != 4 && argc != 6) {
+    fprintf(stderr,
+            "Usage: %s socket input.gif output.gif [producer processor]\n"
+            "       %s socket -\n"
+            "       %s socket quit\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  fd = connect_to(argv[1]);
+  if (fd < 0)
+    return 1;
+  fanswer = fdopen(dup(fd), "r");
+
+  if (argc == 3 && !strcmp(argv[2], "quit")) {
+    send_line(fd, "quit\n");
+  } else if (argc == 3 && !strcmp(argv[2], "-")) {
+    /* Send everything first so the daemon can run the jobs concurrently */
+    int n_requests = 0;
+    while (fgets(request, sizeof(request), stdin) != NULL) {
+      char *in = strtok(request, " \t\n"), *out = strtok(NULL, " \t\n");
+      char *rest = strtok(NULL, "\n");
+      char line[DAEMON_MAX_REQUEST];
+
+      if (in == NULL || out == NULL || !absolute_path(in, input, 1) ||
+          !absolute_path(out, output, 0)) {
+        fprintf(stderr, "Skipping invalid request\n");
+        continue;
+      }
+      if (snprintf(line, sizeof(line), "%s %s %s\n", input, output,
+                   rest == NULL ? "" : rest) >= (int)sizeof(line)) {
+        fprintf(stderr, "Skipping request too long\n");
+        continue;
+      }
+      ok &= send_line(fd, line);
+      n_requests++;
+    }
+    for (int i = 0; i < n_requests; i++)
+      ok &= read_answer(fanswer, "request");
+  } else if (argc != 3) {
+    if (!absolute_path(argv[2], input, 1) ||
+        !absolute_path(argv[3], output, 0)) {
+      fprintf(stderr, "Invalid input or output path\n");
+      return 1;
+    }
+    if (snprintf(request, DAEMON_MAX_REQUEST, "%s %s %s %s\n", input, output,
+                 argc == 6 ? argv[4] : "", argc == 6 ? argv[5] : "") >=
+        DAEMON_MAX_REQUEST) {
+      fprintf(stderr, "Request too long\n");
+      return 1;
+    }
+    ok = send_line(fd, request) && read_answer(fanswer, argv[2]);
+  } else {
+    fprintf(stderr, "Unknown command %s\n", argv[2]);
+    ok = 0;
+  }
+
+  fclose(fanswer);
+  close(fd);
+  return !ok;
+}
@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "blur_kernels.h"
+#include "gif_lib.h"
+#include "gif_mem.h"
+#include "perf_utils.h"
+#include "strip_utils.h"
+#include "trace_utils.h"
+
+/* Strips of the sobel filter span about this many bytes of gray rows */
+#define STRIP_BYTES ((size_t)8 << 20)
+
+/* A region of the scratch file mapped in memory */
+typedef struct {
+  unsigned char *data;
+  size_t length; /* whole pages */
+} scratch_region;
+
+struct strip_gif {
+  GifFileType *g;          /* RasterBits point into rasters */
+  int fd;                  /* scratch file */
+  size_t used;             /* bytes of the scratch file handed out */
+  scratch_region *rasters; /* one per frame */
+  int n_rasters;
+  scratch_region planes;   /* blurred bands of the current frame */
+  unsigned char gray[256]; /* level of each color of the input */
+  unsigned char seen[256]; /* output levels met so far */
+  unsigned char order[256];
+  int n_levels; /* in order of first appearance */
+};
+
+/* A frame being filtered */
+typedef struct {
+  unsigned char *raster;
+  int width, height;
+  int band; /* rows of the top and bottom bands, blurred */
+  unsigned char *top, *bottom;
+} strip_frame;
+
+static int scratch_open(strip_gif *s) {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/sobelf-XXXXXX", dir);
+  s->fd = mkstemp(path);
+  if (s->fd < 0) {
+    fprintf(stderr, "Unable to create a scratch file in %s: %s\n", dir,
+            strerror(errno));
+    return 0;
+  }
+  unlink(path);
+  return 1;
+}
+
+/*
+ * Map size more bytes of the scratch file, zeroed. The blocks are reserved
+ * up front, so that a full disk is reported here rather than as a SIGBUS.
+ */
+static int scratch_map(strip_gif *s, size_t size, scratch_region *r) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = size ? (size + page - 1) / page * page : page;
+  int error = posix_fallocate(s->fd, s->used, length);
+
+  r->data = error ? MAP_FAILED
+                  : mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         s->fd, s->used);
+  if (r->data == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %zu bytes of scratch file: %s\n", length,
+            strerror(error ? error : errno));
+    r->data = NULL;
+    return 0;
+  }
+  r->length = length;
+  s->used += length;
+  return 1;
+}
+
+static void scratch_unmap(scratch_region *r) {
+  if (r->data != NULL)
+    munmap(r->data, r->length);
+  r->data = NULL;
+  r->length = 0;
+}
+
+/* Decode the raster of sp, as DGifSlurp but into the scratch file */
+static int read_raster(strip_gif *s, SavedImage *sp) {
+  static const int offsets[] = {0, 4, 2, 1};
+  static const int jumps[] = {8, 8, 4, 2};
+  GifFileType *g = s->g;
+  int width = sp->ImageDesc.Width, height = sp->ImageDesc.Height;
+  scratch_region *rasters;
+  unsigned char *raster;
+
+  rasters = realloc(s->rasters, sizeof(scratch_region) * (s->n_rasters + 1));
+  if (rasters == NULL)
+    return 0;
+  s->rasters = rasters;
+  if (!scratch_map(s, (size_t)width * height, &rasters[s->n_rasters]))
+    return 0;
+  raster = rasters[s->n_rasters++].data;
+  sp->RasterBits = raster;
+
+  if (width == 0 || height == 0)
+    return DGifGetLine(g, raster, 0) == GIF_OK;
+  if (sp->ImageDesc.Interlace) {
+    for (int pass = 0; pass < 4; pass++)
+      for (int j = offsets[pass]; j < height; j += jumps[pass])
+        if (DGifGetLine(g, raster + (size_t)j * width, width) == GIF_ERROR)
+          return 0;
+  } else {
+    for (int j = 0; j < height; j++)
+      if (DGifGetLine(g, raster + (size_t)j * width, width) == GIF_ERROR)
+        return 0;
+  }
+  return 1;
+}
+
+/* DGifSlurp, with the rasters in the scratch file */
+static int slurp(strip_gif *s) {
+  GifFileType *g = s->g;
+  GifRecordType type;
+  GifByteType *data;
+  int function;
+
+  g->ExtensionBlocks = NULL;
+  g->ExtensionBlockCount = 0;
+
+  do {
+    if (DGifGetRecordType(g, &type) == GIF_ERROR)
+      return 0;
+
+    switch (type) {
+    case IMAGE_DESC_RECORD_TYPE:
+      if (DGifGetImageDesc(g) == GIF_ERROR ||
+          !read_raster(s, &g->SavedImages[g->ImageCount - 1]))
+        return 0;
+      if (g->ExtensionBlocks) {
+        SavedImage *sp = &g->SavedImages[g->ImageCount - 1];
+
+        sp->ExtensionBlocks = g->ExtensionBlocks;
+        sp->ExtensionBlockCount = g->ExtensionBlockCount;
+        g->ExtensionBlocks = NULL;
+        g->ExtensionBlockCount = 0;
+      }
+      break;
+
+    case EXTENSION_RECORD_TYPE:
+      if (DGifGetExtension(g, &function, &data) == GIF_ERROR)
+        return 0;
+      if (data != NULL &&
+          GifAddExtensionBlock(&g->ExtensionBlockCount, &g->ExtensionBlocks,
+                               function, data[0], &data[1]) == GIF_ERROR)
+        return 0;
+      while (data != NULL) {
+        if (DGifGetExtensionNext(g, &data) == GIF_ERROR)
+          return 0;
+        if (data != NULL &&
+            GifAddExtensionBlock(&g->ExtensionBlockCount,
+                                 &g->ExtensionBlocks, CONTINUE_EXT_FUNC_CODE,
+                                 data[0], &data[1]) == GIF_ERROR)
+          return 0;
+      }
+      break;
+
+    default:
+      break;
+    }
+  } while (type != TERMINATE_RECORD_TYPE);
+
+  if (g->ImageCount == 0) {
+    g->Error = D_GIF_ERR_NO_IMAG_DSCR;
+    return 0;
+  }
+  return 1;
+}
+
+static int clamp_level(int moy) { return moy < 0 ? 0 : moy > 255 ? 255 : moy; }
+
+/* Gray level of color c of the input colormap */
+static int color_level(const GifFileType *g, int c) {
+  const GifColorType *color = &g->SColorMap->Colors[c];
+
+  return clamp_level((color->Red + color->Green + color->Blue) / 3);
+}
+
+strip_gif *strip_load(const char *filename) {
+  strip_gif *s = calloc(1, sizeof(strip_gif));
+  int error;
+
+  if (s == NULL)
+    return NULL;
+  s->fd = -1;
+
+  s->g = DGifOpenFileName(filename, &error);
+  if (s->g == NULL) {
+    fprintf(stderr, "Error DGifOpenFileName %s\n", filename);
+    free(s);
+    return NULL;
+  }
+  if (!scratch_open(s)) {
+    strip_free(s);
+    return NULL;
+  }
+
+  if (!slurp(s)) {
+    fprintf(stderr, "Error reading %s: <%s>\n", filename,
+            GifErrorString(s->g->Error));
+    strip_free(s);
+    return NULL;
+  }
+
+  if (s->g->SColorMap == NULL) {
+    fprintf(stderr, "Error global colormap is NULL\n");
+    strip_free(s);
+    return NULL;
+  }
+  for (int i = 0; i < s->g->ImageCount; i++)
+    if (s->g->SavedImages[i].ImageDesc.ColorMap != NULL) {
+      fprintf(stderr, "Error: application does not support local colormap\n");
+      strip_free(s);
+      return NULL;
+    }
+
+  for (int c = 0; c < s->g->SColorMap->ColorCount && c < 256; c++)
+    s->gray[c] = color_level(s->g, c);
+  return s;
+}
+
+int strip_n_images(const strip_gif *s) { return s->g->ImageCount; }
+
+/* Gray levels of row j of the raster */
+static void gray_row(const strip_gif *s, const strip_frame *f, int j,
+                     unsigned char *row) {
+  const unsigned char *raster = f->raster + (size_t)j * f->width;
+
+  for (int k = 0; k < f->width; k++)
+    row[k] = s->gray[raster[k]];
+}
+
+/* Same, blurred if the row lies in a band */
+static void blurred_row(const strip_gif *s, const strip_frame *f, int j,
+                        unsigned char *row) {
+  if (j < f->band)
+    memcpy(row, f->top + (size_t)j * f->width, f->width);
+  else if (j >= f->height - f->band)
+    memcpy(row, f->bottom + (size_t)(j - f->height + f->band) * f->width,
+           f->width);
+  else
+    gray_row(s, f, j, row);
+}
+
+/*
+ * One iteration of the blur over a band of n_rows rows: rows size to
+ * n_rows - size - 1 of p go to new, as the blur kernels compute them,
+ * with running sums over the columns of the stencil. Returns 1 if a level
+ * moved by more than threshold.
+ */
+static int blur_band(const unsigned char *p, unsigned char *new, int *sums,
+                     int width, int n_rows, int size, int threshold) {
+  const int area = (2 * size + 1) * (2 * size + 1);
+  int changed = 0;
+
+  if (n_rows - size <= size || width - size <= size)
+    return 0;
+
+  memset(sums, 0, sizeof(int) * width);
+  for (int j = 0; j <= 2 * size; j++)
+    for (int k = 0; k < width; k++)
+      sums[k] += p[CONV(j, k, width)];
+
+  for (int j = size; j < n_rows - size; j++) {
+    int t = 0;
+
+    if (j > size)
+      for (int k = 0; k < width; k++)
+        sums[k] +=
+            p[CONV(j + size, k, width)] - p[CONV(j - size - 1, k, width)];
+
+    for (int k = 0; k < 2 * size; k++)
+      t += sums[k];
+    for (int k = size; k < width - size; k++) {
+      int v;
+
+      t += sums[k + size];
+      v = t / area;
+      t -= sums[k - size];
+      new[CONV(j, k, width)] = v;
+      changed |= abs(v - p[CONV(j, k, width)]) > threshold;
+    }
+  }
+  return changed;
+}
+
+/* Blur both bands of f until they converge, as apply_blur_filter_once_opt */
+static int blur_frame(strip_gif *s, strip_frame *f, int id,
+                      const filter_params *params) {
+  const size_t band_bytes = (size_t)f->band * f->width;
+  unsigned char *top[2], *bottom[2];
+  int *sums;
+  int changed;
+
+  if (band_bytes == 0)
+    return 1;
+  if (s->planes.length < 4 * band_bytes) {
+    scratch_unmap(&s->planes);
+    if (!scratch_map(s, 4 * band_bytes, &s->planes))
+      return 0;
+  }
+  top[0] = s->planes.data;
+  top[1] = top[0] + band_bytes;
+  bottom[0] = top[1] + band_bytes;
+  bottom[1] = bottom[0] + band_bytes;
+
+  sums = malloc(sizeof(int) * (f->width ? f->width : 1));
+  if (sums == NULL) {
+    fprintf(stderr, "Unable to allocate the sums of %d columns\n", f->width);
+    return 0;
+  }
+
+  /* Convert the bands into grayscale */
+  double t = trace_now();
+  perf_sample ps;
+  perf_begin(&ps);
+  for (int j = 0; j < f->band; j++) {
+    gray_row(s, f, j, top[0] + (size_t)j * f->width);
+    gray_row(s, f, f->height - f->band + j, bottom[0] + (size_t)j * f->width);
+  }
+  memcpy(top[1], top[0], band_bytes);
+  memcpy(bottom[1], bottom[0], band_bytes);
+  perf_end(&ps, perf_gray, 2 * band_bytes);
+  trace_span("gray", id, t);
+
+  t = trace_now();
+  perf_begin(&ps);
+  int cur = 0;
+  do {
+    double t_iter = trace_now();
+
+    changed = blur_band(top[cur], top[!cur], sums, f->width, f->band,
+                        params->blur_size, params->blur_threshold);
+    changed |= blur_band(bottom[cur], bottom[!cur], sums, f->width, f->band,
+                         params->blur_size, params->blur_threshold);
+    cur = !cur;
+    trace_span("blur iteration", id, t_iter);
+  } while (params->blur_threshold > 0 && changed);
+  perf_end(&ps, perf_blur, 2 * band_bytes);
+  trace_span("blur", id, t);
+
+  f->top = top[cur];
+  f->bottom = bottom[cur];
+  free(sums);
+  return 1;
+}
+
+/*
+ * Sobel filter of f written in place into its raster, as output levels,
+ * strip by strip. buf holds the gray rows of a strip of n_rows rows with
+ * the halo rows above and below it; the two last rows of a strip are the
+ * halo and first row of the next one, as the raster is overwritten.
+ */
+static void sobel_frame(strip_gif *s, strip_frame *f, int limit,
+                        unsigned char *buf, int n_rows) {
+  const int width = f->width, height = f->height;
+
+  for (int y0 = 0; y0 < height; y0 += n_rows) {
+    int y1 = y0 + n_rows < height ? y0 + n_rows : height;
+
+    if (y0 > 0)
+      memmove(buf, buf + (size_t)n_rows * width, 2 * (size_t)width);
+    for (int j = y0 > 0 ? y0 + 1 : y0; j <= y1 && j < height; j++)
+      blurred_row(s, f, j, buf + (size_t)(j - y0 + 1) * width);
+
+    for (int j = y0; j < y1; j++) {
+      const unsigned char *row = buf + (size_t)(j - y0 + 1) * width;
+      const unsigned char *up = row - width, *down = row + width;
+      unsigned char *out = f->raster + (size_t)j * width;
+
+      /* The borders keep their blurred level */
+      memcpy(out, row, width);
+      for (int k = 1; j > 0 && j < height - 1 && k < width - 1; k++) {
+        int delta_x = -up[k - 1] + up[k + 1] - 2 * row[k - 1] +
+                      2 * row[k + 1] - down[k - 1] + down[k + 1];
+        int delta_y = down[k + 1] + 2 * down[k] + down[k - 1] - up[k + 1] -
+                      2 * up[k] - up[k - 1];
+
+        out[k] = delta_x * delta_x + delta_y * delta_y > limit ? 255 : 0;
+      }
+
+      for (int k = 0; k < width; k++)
+        if (!s->seen[out[k]]) {
+          s->seen[out[k]] = 1;
+          s->order[s->n_levels++] = out[k];
+        }
+    }
+  }
+}
+
+int strip_filter(strip_gif *s, const filter_params *params) {
+  const int limit = sobel_limit(params->sobel_threshold);
+
+  for (int i = 0; i < s->g->ImageCount; i++) {
+    const GifImageDesc *d = &s->g->SavedImages[i].ImageDesc;
+    strip_frame f = {s->g->SavedImages[i].RasterBits, d->Width, d->Height,
+                     d->Height / 10, NULL, NULL};
+    size_t n_rows = STRIP_BYTES / (f.width ? f.width : 1);
+    unsigned char *buf;
+
+    if (n_rows > (size_t)f.height)
+      n_rows = f.height;
+    if (n_rows < 1)
+      n_rows = 1;
+
+    if (!blur_frame(s, &f, i, params))
+      return 0;
+
+    buf = malloc((n_rows + 2) * (f.width ? f.width : 1));
+    if (buf == NULL) {
+      fprintf(stderr, "Unable to allocate a strip of %zu rows\n", n_rows);
+      return 0;
+    }
+
+    /* Apply sobel filter on pixels */
+    double t = trace_now();
+    perf_sample ps;
+    perf_begin(&ps);
+    sobel_frame(s, &f, limit, buf, n_rows);
+    perf_end(&ps, perf_sobel, (long)f.width * f.height);
+    trace_span("sobel", i, t);
+    free(buf);
+  }
+
+  scratch_unmap(&s->planes);
+  return 1;
+}
+
+/*
+ * Color of the transparency of a graphics control block, as map_pixels
+ * adds it to the n_colors of colormap.
+ */
+static void map_transparency(GifFileType *g, ExtensionBlock *block,
+                             GifColorType *colormap, int *n_colors) {
+  int tr_color, moy, found = -1;
+
+  if (block->Function != GRAPHICS_EXT_FUNC_CODE)
+    return;
+  tr_color = block->Bytes[3];
+  if (tr_color < 0 || tr_color >= 255)
+    return;
+
+  moy = color_level(g, tr_color);
+  for (int k = 0; k < *n_colors; k++)
+    if (moy == colormap[k].Red)
+      found = k;
+  if (found == -1) {
+    colormap[*n_colors].Red = colormap[*n_colors].Green =
+        colormap[*n_colors].Blue = moy;
+    found = (*n_colors)++;
+  }
+  block->Bytes[3] = found;
+}
+
+/*
+ * map_pixels for gray levels: the background, the transparent colors and
+ * the levels of the frames in order of first appearance, each raster level
+ * becoming the last entry holding it.
+ */
+static int map_levels(strip_gif *s) {
+  GifFileType *g = s->g;
+  GifColorType colormap[256];
+  unsigned char index[256];
+  ColorMapObject *cmo;
+  int n_colors = 1;
+
+  for (int c = 0; c < 256; c++)
+    colormap[c].Red = colormap[c].Green = colormap[c].Blue = 255;
+  colormap[0].Red = colormap[0].Green = colormap[0].Blue =
+      color_level(g, g->SBackGroundColor);
+  g->SBackGroundColor = 0;
+
+  for (int j = 0; j < g->ExtensionBlockCount; j++)
+    map_transparency(g, &g->ExtensionBlocks[j], colormap, &n_colors);
+  for (int i = 0; i < g->ImageCount; i++)
+    for (int j = 0; j < g->SavedImages[i].ExtensionBlockCount; j++)
+      map_transparency(g, &g->SavedImages[i].ExtensionBlocks[j], colormap,
+                       &n_colors);
+
+  for (int l = 0; l < s->n_levels; l++) {
+    int found = 0;
+
+    for (int k = 0; k < n_colors; k++)
+      found |= colormap[k].Red == s->order[l];
+    if (!found) {
+      colormap[n_colors].Red = colormap[n_colors].Green =
+          colormap[n_colors].Blue = s->order[l];
+      n_colors++;
+    }
+  }
+
+  /* Round up to a power of 2 */
+  n_colors = 1 << GifBitSize(n_colors);
+
+  cmo = GifMakeMapObject(n_colors, colormap);
+  if (cmo == NULL) {
+    fprintf(stderr, "Error while creating a ColorMapObject w/ %d color(s)\n",
+            n_colors);
+    return 0;
+  }
+  GifFreeMapObject(g->SColorMap);
+  g->SColorMap = cmo;
+
+  for (int k = 0; k < n_colors; k++)
+    index[colormap[k].Red] = k;
+  for (int i = 0; i < g->ImageCount; i++) {
+    const GifImageDesc *d = &g->SavedImages[i].ImageDesc;
+    unsigned char *raster = g->SavedImages[i].RasterBits;
+
+    for (size_t j = 0; j < (size_t)d->Width * d->Height; j++)
+      raster[j] = index[raster[j]];
+  }
+  return 1;
+}
+
+int strip_store(const char *filename, strip_gif *s) {
+  double t = trace_now();
+  long n_pixels = 0;
+  GifFileType *g2;
+  gif_membuf mem;
+  perf_sample ps;
+  int error, ok;
+
+  for (int i = 0; i < s->g->ImageCount; i++)
+    n_pixels += (long)s->g->SavedImages[i].ImageDesc.Width *
+                s->g->SavedImages[i].ImageDesc.Height;
+
+  perf_begin(&ps);
+  if (!map_levels(s))
+    return 0;
+  perf_end(&ps, perf_palette, n_pixels);
+  trace_span("palette", -1, t);
+
+  /* Encoded straight into the output file, however large */
+  t = trace_now();
+  perf_begin(&ps);
+  g2 = gif_mem_open_mapped(&mem, filename, n_pixels + (1 << 16), &error);
+  if (g2 == NULL) {
+    fprintf(stderr, "Error EGifOpenFileName %s\n", filename);
+    return 0;
+  }
+  ok = output_modified_gif(g2, s->g);
+  ok = gif_mem_close_file(&mem, filename) && ok;
+  perf_end(&ps, perf_lzw, n_pixels);
+  trace_span("encode", -1, t);
+  return ok;
+}
+
+void strip_free(strip_gif *s) {
+  /* The rasters are not giflib's to free */
+  for (int i = 0; i < s->g->ImageCount; i++)
+    s->g->SavedImages[i].RasterBits = NULL;
+  for (int i = 0; i < s->n_rasters; i++)
+    scratch_unmap(&s->rasters[i]);
+  scratch_unmap(&s->planes);
+  free(s->rasters);
+  DGifCloseFile(s->g, NULL);
+  if (s->fd >= 0)
+    close(s->fd);
+  free(s);
+}
@@ -0,0 +1,164 @@
+#include "trace_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  int id;
+  double start, end;
+} trace_event;
+
+/* Events of one thread, chained in the list of every buffer */
+typedef struct trace_buffer {
+  trace_event *events;
+  int n_events;
+  int capacity;
+  int tid;
+  struct trace_buffer *next;
+} trace_buffer;
+
+static int recording;
+static struct timespec origin;
+static trace_buffer *buffers;
+static int n_buffers;
+static _Thread_local trace_buffer *own;
+
+void trace_start(void) {
+  clock_gettime(CLOCK_MONOTONIC, &origin);
+  recording = 1;
+}
+
+double trace_now(void) {
+  struct timespec t;
+
+  if (!recording)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - origin.tv_sec) + (t.tv_nsec - origin.tv_nsec) / 1e9;
+}
+
+/* Buffer of the calling thread, registered on its first event */
+static trace_buffer *own_buffer(void) {
+  if (own == NULL) {
+    own = calloc(1, sizeof(trace_buffer));
+    if (own == NULL)
+      return NULL;
+#pragma omp critical(trace_buffers)
+    {
+      own->tid = n_buffers++;
+      own->next = buffers;
+      buffers = own;
+    }
+  }
+  return own;
+}
+
+void trace_span(const char *name, int id, double start) {
+  trace_buffer *b;
+  double end;
+
+  if (!recording || (b = own_buffer()) == NULL)
+    return;
+  end = trace_now();
+
+  if (b->n_events == b->capacity) {
+    int capacity = b->capacity ? 2 * b->capacity : 1024;
+    trace_event *events =
+        realloc(b->events, sizeof(trace_event) * capacity);
+    if (events == NULL)
+      return;
+    b->events = events;
+    b->capacity = capacity;
+  }
+  b->events[b->n_events++] = (trace_event){name, id, start, end};
+}
+
+/* Complete event, microseconds, closed by the caller */
+#define TRACE_EVENT                                                            \
+  "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"           \
+  "\"dur\":%.3f"
+
+/* Append one line of n bytes to *out, growing it as needed */
+static int append(char **out, size_t *size, size_t *capacity,
+                  const char *line, int n) {
+  if (n < 0)
+    return 0;
+  if (*size + n > *capacity) {
+    size_t c = *capacity ? 2 * *capacity : 1 << 16;
+    while (c < *size + n)
+      c *= 2;
+    char *grown = realloc(*out, c);
+    if (grown == NULL)
+      return 0;
+    *out = grown;
+    *capacity = c;
+  }
+  memcpy(*out + *size, line, n);
+  *size += n;
+  return 1;
+}
+
+char *trace_json(int pid, size_t *size) {
+  char *out = NULL, line[256];
+  size_t capacity = 0;
+  int ok, n;
+
+  *size = 0;
+  if (!recording)
+    return NULL;
+
+  n = snprintf(line, sizeof(line),
+               "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+               "\"args\":{\"name\":\"rank %d\"}},\n",
+               pid, pid);
+  ok = append(&out, size, &capacity, line, n);
+
+  for (trace_buffer *b = buffers; ok && b != NULL; b = b->next)
+    for (int i = 0; ok && i < b->n_events; i++) {
+      const trace_event *e = b->events + i;
+
+      if (e->id >= 0)
+        n = snprintf(line, sizeof(line),
+                     TRACE_EVENT ",\"args\":{\"frame\":%d}},\n", e->name,
+                     pid, b->tid, e->start * 1e6, (e->end - e->start) * 1e6,
+                     e->id);
+      else
+        n = snprintf(line, sizeof(line), TRACE_EVENT "},\n", e->name, pid,
+                     b->tid, e->start * 1e6, (e->end - e->start) * 1e6);
+      ok = n < (int)sizeof(line) && append(&out, size, &capacity, line, n);
+    }
+
+  if (!ok) {
+    fprintf(stderr, "Unable to allocate the trace events\n");
+    free(out);
+    *size = 0;
+    return NULL;
+  }
+  return out;
+}
+
+int trace_write(const char *filename, const char *events, size_t size) {
+  FILE *f = fopen(filename, "w");
+  int ok;
+
+  if (f == NULL) {
+    fprintf(stderr, "Could not open trace file (%s)\n", filename);
+    return 0;
+  }
+
+  // the last event is not followed by a comma in JSON
+  if (size >= 2)
+    size -= 2;
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+  fwrite(events, 1, size, f);
+  fputs("\n]}\n", f);
+  ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error while writing the trace (%s)\n", filename);
+    return 0;
+  }
+  return 1;
+}
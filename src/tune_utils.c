@@ -0,0 +1,454 @@
+#include "tune_utils.h"
+#include "backends.h"
+#include "mem_utils.h"
+
+#include <mpi.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define SOBELF_DEBUG 0
+#define ROOT 0
+
+/* Frames of the processor benchmarks, the costs are fitted on both */
+#define TUNE_SMALL_SIDE 64
+#define TUNE_LARGE_SIDE 512
+#define TUNE_REPEAT 2
+
+/* Ping-pongs of the MPI benchmark */
+#define TUNE_SMALL_MESSAGES 100
+#define TUNE_LARGE_MESSAGES 5
+#define TUNE_LARGE_INTS (1 << 18)
+
+static cost_model tuned;
+
+/* Processors worth benchmarking, the reference one is never the fastest */
+static const enum processor tuned_processors[] = {proc_opt, proc_omp,
+                                                  proc_simd, proc_cuda};
+#define N_TUNED (sizeof(tuned_processors) / sizeof(tuned_processors[0]))
+
+static double now(void) {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec / 1e6;
+}
+
+void tune_cache_path(char *path, int size) {
+  const char *env = getenv("SOBELF_COST_MODEL");
+  const char *home = getenv("HOME");
+  char host[64] = "localhost";
+
+  if (env != NULL) {
+    snprintf(path, size, "%s", env);
+    return;
+  }
+  gethostname(host, sizeof(host) - 1);
+  snprintf(path, size, "%s/.sobelf-%s.model", home ? home : "/tmp", host);
+}
+
+static int load_model(const char *path, cost_model *model) {
+  char line[256];
+  int version = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL)
+    return 0;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    int p;
+    double a, b;
+
+    if (sscanf(line, "sobelf-cost-model %d", &version) == 1)
+      continue;
+    if (sscanf(line, "host %63s", model->host) == 1)
+      continue;
+    if (sscanf(line, "threads %d", &model->n_threads) == 1)
+      continue;
+    if (sscanf(line, "proc %d %lf %lf", &p, &a, &b) == 3 && p >= 0 &&
+        p < n_processors) {
+      model->frame_cost[p] = a;
+      model->pixel_cost[p] = b;
+      continue;
+    }
+    if (sscanf(line, "mpi %lf %lf", &a, &b) == 2) {
+      model->message_cost = a;
+      model->byte_cost = b;
+    }
+  }
+  fclose(f);
+  return version == TUNE_CACHE_VERSION;
+}
+
+static void save_model(const char *path, const cost_model *model) {
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL) {
+    fprintf(stderr, "Unable to save the cost model in %s\n", path);
+    return;
+  }
+
+  fprintf(f, "sobelf-cost-model %d\n", TUNE_CACHE_VERSION);
+  fprintf(f, "host %s\n", model->host);
+  fprintf(f, "threads %d\n", model->n_threads);
+  for (int p = 0; p < n_processors; p++)
+    fprintf(f, "proc %d %.9g %.9g\n", p, model->frame_cost[p],
+            model->pixel_cost[p]);
+  fprintf(f, "mpi %.9g %.9g\n", model->message_cost, model->byte_cost);
+  fclose(f);
+}
+
+/* Gradients plus noise, so that the blur iterates a few times like photos */
+static void fill_frame(pixel *p, int width, int height) {
+  unsigned int seed = 12345;
+
+  for (int j = 0; j < height; j++) {
+    for (int k = 0; k < width; k++) {
+      seed = seed * 1103515245 + 12345;
+      int v = (255 * k / width + 255 * j / height) / 2 +
+              (int)((seed >> 16) & 63) - 32;
+      v = v < 0 ? 0 : v > 255 ? 255 : v;
+
+      p[CONV(j, k, width)].r = v;
+      p[CONV(j, k, width)].g = 255 - v;
+      p[CONV(j, k, width)].b = v / 2;
+    }
+  }
+}
+
+/* Best of TUNE_REPEAT runs of pipe on a side x side frame */
+static double time_frame(pipe_fn pipe, int side) {
+  filter_params params = FILTER_PARAMS_DEFAULT;
+  double best = -1;
+
+  for (int r = 0; r < TUNE_REPEAT; r++) {
+    img image = {side, side, 0, mem_alloc(side * side * sizeof(pixel))};
+    if (image.p == NULL)
+      return -1;
+    fill_frame(image.p, side, side);
+
+    double t = now();
+    pipe(&image, &params);
+    t = now() - t;
+
+    free(image.p);
+    if (best < 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+static void calibrate_processors(cost_model *model) {
+  const double n_small = TUNE_SMALL_SIDE * TUNE_SMALL_SIDE;
+  const double n_large = TUNE_LARGE_SIDE * TUNE_LARGE_SIDE;
+
+  for (int p = 0; p < n_processors; p++) {
+    model->frame_cost[p] = -1;
+    model->pixel_cost[p] = -1;
+  }
+
+  for (size_t i = 0; i < N_TUNED; i++) {
+    enum processor p = tuned_processors[i];
+
+    if (!backend_available(p))
+      continue;
+
+    double t_small = time_frame(backend_pipe(p), TUNE_SMALL_SIDE);
+    double t_large = time_frame(backend_pipe(p), TUNE_LARGE_SIDE);
+    if (t_small < 0 || t_large < 0)
+      continue;
+
+    double pixel_cost = (t_large - t_small) / (n_large - n_small);
+    if (pixel_cost < 1e-12)
+      pixel_cost = 1e-12;
+    double frame_cost = t_small - pixel_cost * n_small;
+
+    model->pixel_cost[p] = pixel_cost;
+    model->frame_cost[p] = frame_cost > 0 ? frame_cost : 0;
+  }
+  model->n_threads = omp_get_max_threads();
+}
+
+/* Ping-pong between the root and rank 1, other ranks return at once */
+static void calibrate_mpi(cost_model *model, int rank) {
+  int *buf;
+  double t;
+
+  if (rank > 1)
+    return;
+
+  buf = calloc(TUNE_LARGE_INTS, sizeof(int));
+  if (rank == ROOT) {
+    t = now();
+    for (int i = 0; i < TUNE_SMALL_MESSAGES; i++) {
+      MPI_Send(buf, 1, MPI_INT, 1, 0, MPI_COMM_WORLD);
+      MPI_Recv(buf, 1, MPI_INT, 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+    model->message_cost = (now() - t) / (2 * TUNE_SMALL_MESSAGES);
+
+    t = now();
+    for (int i = 0; i < TUNE_LARGE_MESSAGES; i++) {
+      MPI_Send(buf, TUNE_LARGE_INTS, MPI_INT, 1, 0, MPI_COMM_WORLD);
+      MPI_Recv(buf, TUNE_LARGE_INTS, MPI_INT, 1, 0, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+    }
+    t = (now() - t) / (2 * TUNE_LARGE_MESSAGES) - model->message_cost;
+    model->byte_cost = t > 0 ? t / (TUNE_LARGE_INTS * sizeof(int)) : 0;
+  } else {
+    for (int i = 0; i < TUNE_SMALL_MESSAGES; i++) {
+      MPI_Recv(buf, 1, MPI_INT, ROOT, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      MPI_Send(buf, 1, MPI_INT, ROOT, 0, MPI_COMM_WORLD);
+    }
+    for (int i = 0; i < TUNE_LARGE_MESSAGES; i++) {
+      MPI_Recv(buf, TUNE_LARGE_INTS, MPI_INT, ROOT, 0, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+      MPI_Send(buf, TUNE_LARGE_INTS, MPI_INT, ROOT, 0, MPI_COMM_WORLD);
+    }
+  }
+  free(buf);
+}
+
+void tune_init(int rank, int n_workers) {
+  char path[4096];
+  char host[64] = "localhost";
+  int todo[2] = {0, 0}; /* benchmark the processors, the network */
+  int mpi;
+
+  if (rank == ROOT) {
+    cost_model cached;
+
+    memset(&cached, 0, sizeof(cached));
+    cached.message_cost = -1;
+    gethostname(host, sizeof(host) - 1);
+    tune_cache_path(path, sizeof(path));
+
+    /* Stale when measured elsewhere, with other threads or GPUs */
+    int loaded = load_model(path, &cached);
+    todo[0] = !loaded || strcmp(cached.host, host) ||
+              cached.n_threads != omp_get_max_threads() ||
+              (cached.pixel_cost[proc_cuda] >= 0) != backend_available(proc_cuda);
+    todo[1] = n_workers > 0 && (todo[0] || cached.message_cost < 0);
+
+    tuned = cached;
+    if (todo[0]) {
+      tuned.message_cost = -1;
+      tuned.byte_cost = -1;
+      snprintf(tuned.host, sizeof(tuned.host), "%s", host);
+      printf("Calibrating the cost model into %s\n", path);
+      calibrate_processors(&tuned);
+    }
+  }
+
+  /* Single process runs do not initialise MPI */
+  MPI_Initialized(&mpi);
+  if (mpi)
+    MPI_Bcast(todo, 2, MPI_INT, ROOT, MPI_COMM_WORLD);
+  if (todo[1])
+    calibrate_mpi(&tuned, rank);
+
+  if (rank == ROOT && (todo[0] || todo[1]))
+    save_model(path, &tuned);
+
+  if (mpi)
+    MPI_Bcast(&tuned, sizeof(tuned), MPI_BYTE, ROOT, MPI_COMM_WORLD);
+}
+
+double tune_batch_bytes(void) {
+  cost_model model = tuned;
+
+  /* Explicit configurations skip tune_init, an earlier run may have saved it */
+  if (model.message_cost <= 0 || model.byte_cost <= 0) {
+    char path[4096];
+    char host[64] = "localhost";
+
+    memset(&model, 0, sizeof(model));
+    gethostname(host, sizeof(host) - 1);
+    tune_cache_path(path, sizeof(path));
+    if (!load_model(path, &model) || strcmp(model.host, host))
+      return -1;
+  }
+
+  if (model.message_cost <= 0 || model.byte_cost <= 0)
+    return -1;
+  return 4 * model.message_cost / model.byte_cost;
+}
+
+static double frame_time(enum processor p, long n_pixels) {
+  return tuned.frame_cost[p] + tuned.pixel_cost[p] * n_pixels;
+}
+
+enum processor tune_best_processor(long n_pixels, int parallel) {
+  enum processor best = proc_opt;
+  double best_time = -1;
+
+  for (size_t i = 0; i < N_TUNED; i++) {
+    enum processor p = tuned_processors[i];
+
+    if (tuned.pixel_cost[p] < 0)
+      continue;
+    if (!parallel && backend_get(p)->parallel)
+      continue;
+    /* The model comes from the root, this rank may lack the backend */
+    if (!backend_available(p))
+      continue;
+
+    double t = frame_time(p, n_pixels);
+    if (best_time < 0 || t < best_time) {
+      best = p;
+      best_time = t;
+    }
+  }
+  return best;
+}
+
+void tune_pipe(img *image, const filter_params *params) {
+  long n_pixels = (long)image->width * image->height;
+  enum processor p = tune_best_processor(n_pixels, !omp_in_parallel());
+
+  backend_pipe(p)(image, params);
+}
+
+/*
+ * Speedup of t threads sharing the memory of a rank, Amdahl's law fitted on
+ * the omp processor against the sequential one. Frames filtered side by side
+ * compete for the same bandwidth as the threads of one frame.
+ * */
+static double thread_speedup(int t) {
+  double s, f;
+
+  if (t <= 1 || tuned.n_threads <= 1 || tuned.pixel_cost[proc_omp] <= 0 ||
+      tuned.pixel_cost[proc_opt] <= 0)
+    return t > 1 ? t : 1;
+
+  s = tuned.pixel_cost[proc_opt] / tuned.pixel_cost[proc_omp];
+  f = (1 - 1 / s) / (1 - 1.0 / tuned.n_threads);
+  f = f < 0 ? 0 : f > 1 ? 1 : f;
+  return 1 / ((1 - f) + f / t);
+}
+
+/*
+ * Estimated time of one configuration, each rank filtering `slots` frames
+ * at once: the frames run one after the other (prod_def), spread over the
+ * threads (prod_omp), over the workers and the root while it ships them one
+ * at a time (prod_mpi), claimed by every rank through the window (prod_rma)
+ * or split up front and scattered (prod_static).
+ * */
+static double estimate(const img *images, int n_images, int n_workers,
+                       enum producer prod, enum processor proc, int slots) {
+  int parallel = prod != prod_omp && slots == 1;
+  double slowdown = slots / thread_speedup(slots);
+  double sum = 0, longest = 0, comm = 0, bytes = 0;
+
+  for (int i = 0; i < n_images; i++) {
+    long n = (long)images[i].width * images[i].height;
+    enum processor p =
+        proc == proc_auto ? tune_best_processor(n, parallel) : proc;
+    double t = frame_time(p, n) * slowdown;
+    double c = 0;
+
+    /* frame and result, the packages holding 3n + 4 ints */
+    if (prod == prod_mpi)
+      c = 2 * tuned.message_cost +
+          2 * tuned.byte_cost * (3 * n + 4) * sizeof(int);
+    /* claim, get and put of 3n ints */
+    else if (prod == prod_rma)
+      c = 3 * tuned.message_cost + 2 * tuned.byte_cost * 3 * n * sizeof(int);
+    bytes += 3 * n * sizeof(int);
+    comm += c;
+    t += c;
+    sum += t;
+    if (t > longest)
+      longest = t;
+  }
+
+  switch (prod) {
+  case prod_omp:
+    sum /= slots;
+    break;
+  case prod_mpi:
+    /* the root filters one frame at a time in the time it does not ship */
+    sum = (sum + comm) / (n_workers * slots + 1);
+    if (comm > sum)
+      sum = comm;
+    break;
+  case prod_rma:
+    /* the root claims like any rank, its link carries every frame */
+    sum /= (n_workers + 1) * slots;
+    if (comm > sum)
+      sum = comm;
+    break;
+  case prod_static:
+    /* the workers' share goes out and back before and after the filter */
+    comm = 2 * n_workers * tuned.message_cost +
+           2 * tuned.byte_cost * bytes * n_workers / (n_workers + 1);
+    sum /= (n_workers + 1) * slots;
+    return comm + (sum > longest ? sum : longest);
+  default:
+    return sum;
+  }
+  return sum > longest ? sum : longest;
+}
+
+/* 1, 2, 4... then max */
+static int next_threads(int t, int max) {
+  return t < max && 2 * t > max ? max : 2 * t;
+}
+
+double tune_decide(const img *images, int n_images, int n_workers,
+                   enum producer *prod, enum processor *proc,
+                   int *n_threads) {
+  const enum producer producers[] = {prod_def, prod_omp, prod_mpi, prod_rma,
+                                     prod_static};
+  const enum processor processors[] = {proc_opt, proc_omp, proc_simd,
+                                       proc_cuda, proc_auto};
+  int max_threads = tuned.n_threads > 1 ? tuned.n_threads : 1;
+  double best = -1;
+
+  *prod = prod_def;
+  *proc = proc_opt;
+  *n_threads = 1;
+
+  for (size_t i = 0; i < sizeof(producers) / sizeof(producers[0]); i++) {
+    for (size_t j = 0; j < sizeof(processors) / sizeof(processors[0]); j++) {
+      enum producer pr = producers[i];
+      enum processor pc = processors[j];
+      int mpi = pr == prod_mpi || pr == prod_rma || pr == prod_static;
+      int parallel = backend_get(pc)->parallel;
+
+      if (pc != proc_auto && tuned.pixel_cost[pc] < 0)
+        continue;
+      if (pr == prod_omp && parallel)
+        continue;
+      if (mpi && (n_workers <= 0 || tuned.message_cost < 0))
+        continue;
+
+      /*
+       * Frames filtered at once on each rank: the omp producer uses every
+       * thread, the mpi ones try 1, 2, 4... threads of sequential processors
+       * as contention can make fewer of them finish sooner.
+       * */
+      for (int t = 1; t <= max_threads; t = next_threads(t, max_threads)) {
+        if (pr == prod_omp && t != max_threads)
+          continue;
+        if ((pr == prod_def || parallel) && t > 1)
+          break;
+
+        double e = estimate(images, n_images, n_workers, pr, pc, t);
+#if SOBELF_DEBUG
+        printf("TUNE: producer %d processor %d threads %d: %lf s\n", pr, pc,
+               t, e);
+#endif
+        /* proc_auto only when it beats every single processor */
+        if (best < 0 || e < best * (pc == proc_auto ? 0.95 : 1)) {
+          best = e;
+          *prod = pr;
+          *proc = pc;
+          *n_threads = t;
+        }
+      }
+    }
+  }
+  return best;
+}
@@ -1,8 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "gif_lib.h"
+#include "gif_mem.h"
+#include "mem_utils.h"
+#include "perf_utils.h"
+#include "trace_utils.h"
 #include "utils.h"
 
 void pkg2img(img_pkg pkg, img *image, int *sender_rank) {
@@ -12,7 +17,7 @@ void pkg2img(img_pkg pkg, img *image, int *sender_rank) {
   image->id = pkg[2];
   if (sender_rank != NULL)
     *sender_rank = pkg[3];
-  for (int i = 0; i < image->width * image->height; i++) {
+  for (size_t i = 0; i < (size_t)image->width * image->height; i++) {
     image->p[i].r = pkg[header + 3 * i + 0];
     image->p[i].g = pkg[header + 3 * i + 1];
     image->p[i].b = pkg[header + 3 * i + 2];
@@ -25,20 +30,20 @@ void img2pkg(img image, img_pkg pkg, int sender_rank) {
   pkg[1] = image.height;
   pkg[2] = image.id;
   pkg[3] = sender_rank;
-  for (int i = 0; i < image.width * image.height; i++) {
+  for (size_t i = 0; i < (size_t)image.width * image.height; i++) {
     pkg[header + 3 * i + 0] = image.p[i].r;
     pkg[header + 3 * i + 1] = image.p[i].g;
     pkg[header + 3 * i + 2] = image.p[i].b;
   }
 }
 
-int sizeofimg(img image) { return 3 * image.height * image.width + 4; }
-int sizeofp(int pkg_size) { return pkg_size - 4; }
+long sizeofimg(img image) { return 3L * image.height * image.width + 4; }
+long sizeofp(long pkg_size) { return pkg_size - 4; }
 
 void printimg(img image) {
   printf("h: %d,  w: %d, id: %d \n", image.height, image.width, image.id);
   printf("p: [");
-  for (int j = 0; j < image.height * image.width; j++)
+  for (size_t j = 0; j < (size_t)image.height * image.width; j++)
     printf("(%d, %d, %d) ", image.p[j].r, image.p[j].g, image.p[j].b);
   printf("]\n");
 }
@@ -85,14 +90,8 @@ int test_pkg_img(void) {
  */
 animated_gif *load_pixels(char *filename) {
   GifFileType *g;
-  ColorMapObject *colmap;
-  int error;
-  int n_images;
-  int *width;
-  int *height;
-  pixel **p;
-  int i;
   animated_gif *image;
+  int error;
 
   /* Open the GIF image (read mode) */
   g = DGifOpenFileName(filename, &error);
@@ -101,6 +100,50 @@ animated_gif *load_pixels(char *filename) {
     return NULL;
   }
 
+  image = load_pixels_from_gif(g, mem_pixel_alloc, NULL);
+  if (image == NULL)
+    DGifCloseFile(g, NULL);
+  return image;
+}
+
+/*
+ * Load a GIF already read into memory. mem refers to data, which must
+ * outlive the returned structure.
+ */
+animated_gif *load_pixels_mem(gif_membuf *mem, const void *data,
+                              size_t size) {
+  GifFileType *g;
+  animated_gif *image;
+  int error;
+
+  g = gif_mem_open_read(mem, data, size, &error);
+  if (g == NULL) {
+    fprintf(stderr, "Error DGifOpen: %s\n", GifErrorString(error));
+    return NULL;
+  }
+
+  image = load_pixels_from_gif(g, mem_pixel_alloc, NULL);
+  if (image == NULL)
+    DGifCloseFile(g, NULL);
+  return image;
+}
+
+/*
+ * Decode a GIF opened for reading (from a file or through DGifOpen) into
+ * an animated_gif. The frame buffers are obtained from alloc, or malloc
+ * when it is NULL.
+ */
+animated_gif *load_pixels_from_gif(GifFileType *g, pixel_alloc alloc,
+                                   void *alloc_arg) {
+  ColorMapObject *colmap;
+  int error;
+  int n_images;
+  int *width;
+  int *height;
+  pixel **p;
+  int i;
+  animated_gif *image;
+
   /* Read the GIF image */
   error = DGifSlurp(g);
   if (error != GIF_OK) {
@@ -160,10 +203,13 @@ animated_gif *load_pixels(char *filename) {
   }
 
   for (i = 0; i < n_images; i++) {
-    p[i] = (pixel *)malloc(width[i] * height[i] * sizeof(pixel));
+    if (alloc != NULL)
+      p[i] = alloc((size_t)width[i] * height[i], alloc_arg);
+    else
+      p[i] = (pixel *)malloc((size_t)width[i] * height[i] * sizeof(pixel));
     if (p[i] == NULL) {
-      fprintf(stderr, "Unable to allocate %d-th array of %d pixels\n", i,
-              width[i] * height[i]);
+      fprintf(stderr, "Unable to allocate %d-th array of %zu pixels\n", i,
+              (size_t)width[i] * height[i]);
       return NULL;
     }
   }
@@ -172,7 +218,7 @@ animated_gif *load_pixels(char *filename) {
 
   /* For each image */
   for (i = 0; i < n_images; i++) {
-    int j;
+    size_t j;
 
     /* Get the local colormap if needed */
     if (g->SavedImages[i].ImageDesc.ColorMap) {
@@ -185,7 +231,7 @@ animated_gif *load_pixels(char *filename) {
     }
 
     /* Traverse the image and fill pixels */
-    for (j = 0; j < width[i] * height[i]; j++) {
+    for (j = 0; j < (size_t)width[i] * height[i]; j++) {
       int c;
 
       c = g->SavedImages[i].RasterBits[j];
@@ -218,20 +264,43 @@ animated_gif *load_pixels(char *filename) {
   return image;
 }
 
+/*
+ * Write g to filename, encoded in memory (or in a mapping of the file) so
+ * that it reaches the file in one piece rather than in 255-byte blocks.
+ */
 int output_modified_read_gif(char *filename, GifFileType *g) {
   GifFileType *g2;
-  int error2;
+  gif_membuf mem;
+  size_t size_hint = 0;
+  int error2, ok;
 
 #if SOBELF_DEBUG
   printf("Starting output to file %s\n", filename);
 #endif
 
-  g2 = EGifOpenFileName(filename, false, &error2);
+  // LZW rarely needs more than a byte per pixel
+  for (int i = 0; i < g->ImageCount; i++)
+    size_hint += (size_t)g->SavedImages[i].ImageDesc.Width *
+                 g->SavedImages[i].ImageDesc.Height;
+  size_hint += 1 << 16;
+
+  g2 = gif_mem_open_file(&mem, filename, size_hint, &error2);
   if (g2 == NULL) {
     fprintf(stderr, "Error EGifOpenFileName %s\n", filename);
     return 0;
   }
 
+  ok = output_modified_gif(g2, g);
+  return gif_mem_close_file(&mem, filename) && ok;
+}
+
+/*
+ * Write g through g2, a GIF opened for writing (to a file or through
+ * EGifOpen). g2 is closed once done.
+ */
+int output_modified_gif(GifFileType *g2, GifFileType *g) {
+  int error2;
+
   g2->SWidth = g->SWidth;
   g2->SHeight = g->SHeight;
   g2->SColorResolution = g->SColorResolution;
@@ -250,10 +319,248 @@ int output_modified_read_gif(char *filename, GifFileType *g) {
     return 0;
   }
 
+  /* g2 wrote a copy of the colormap, which stays g's to release */
   return 1;
 }
 
-int store_pixels(char *filename, animated_gif *image) {
+/* Index of the colormap that no pixel nor extension uses, -1 if none */
+static int unused_color(GifFileType *g) {
+  unsigned char used[256] = {0};
+  GraphicsControlBlock gcb;
+
+  used[g->SBackGroundColor] = 1;
+  for (int i = 0; i < g->ImageCount; i++) {
+    const SavedImage *sp = &g->SavedImages[i];
+    size_t n = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height;
+
+    for (size_t j = 0; j < n; j++)
+      used[sp->RasterBits[j]] = 1;
+    DGifSavedExtensionToGCB(g, i, &gcb);
+    if (gcb.TransparentColor != NO_TRANSPARENT_COLOR)
+      used[gcb.TransparentColor] = 1;
+  }
+
+  for (int c = 0; c < g->SColorMap->ColorCount; c++)
+    if (!used[c])
+      return c;
+  return -1;
+}
+
+/*
+ * Screen as shown after each frame, in colors of the global map, -1 where
+ * nothing known was drawn (before the first frame, after a disposal to the
+ * background or under a local colormap).
+ */
+typedef struct {
+  short *colors;
+  short *saved; /* before a frame to be disposed of to the previous one */
+  int width, height;
+} gif_canvas;
+
+/* The frame lies on the screen and leaves it as drawn once displayed */
+static int croppable(GifFileType *g, int i, const GraphicsControlBlock *gcb) {
+  const GifImageDesc *d = &g->SavedImages[i].ImageDesc;
+
+  return d->ColorMap == NULL && gcb->DisposalMode != DISPOSE_BACKGROUND &&
+         d->Left >= 0 && d->Top >= 0 && d->Left + d->Width <= g->SWidth &&
+         d->Top + d->Height <= g->SHeight;
+}
+
+/* Draw frame i over the canvas, transparent being its transparent color */
+static void paint(gif_canvas *c, GifFileType *g, int i, int transparent) {
+  const SavedImage *sp = &g->SavedImages[i];
+  const GifImageDesc *d = &sp->ImageDesc;
+
+  for (int y = 0; y < d->Height; y++)
+    for (int x = 0; x < d->Width; x++) {
+      int cx = d->Left + x, cy = d->Top + y;
+      int v = sp->RasterBits[y * d->Width + x];
+
+      if (cx < 0 || cy < 0 || cx >= c->width || cy >= c->height ||
+          v == transparent)
+        continue;
+      c->colors[cy * c->width + cx] = d->ColorMap == NULL ? v : -1;
+    }
+}
+
+/*
+ * Crop frame i to the bounding box of the pixels it changes on the canvas,
+ * then draw it there. The unchanged pixels inside the box become
+ * transparent, with the transparent color of the frame or else spare when
+ * it is a free color, if that leaves fewer color changes along the rows, a
+ * rough measure of what LZW will make of them. A frame without changes
+ * keeps one pixel.
+ */
+static int crop_frame(gif_canvas *c, GifFileType *g, int i,
+                      GraphicsControlBlock *gcb, int spare) {
+  SavedImage *sp = &g->SavedImages[i];
+  const GifByteType *cur = sp->RasterBits;
+  int width = sp->ImageDesc.Width, height = sp->ImageDesc.Height;
+  int left = sp->ImageDesc.Left, top = sp->ImageDesc.Top;
+  int own = gcb->TransparentColor;
+  int x0 = width, y0 = height, x1 = -1, y1 = -1;
+  long changes = 0, changes_transparent = 0;
+  GifByteType *raster;
+
+#define SHOWN(x, y) c->colors[(top + (y)) * c->width + left + (x)]
+#define CHANGED(x, y)                                                          \
+  (cur[(y) * width + (x)] != own && cur[(y) * width + (x)] != SHOWN(x, y))
+
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      if (CHANGED(x, y)) {
+        x0 = x < x0 ? x : x0;
+        x1 = x > x1 ? x : x1;
+        y0 = y < y0 ? y : y0;
+        y1 = y;
+      }
+  if (x1 < 0)
+    x0 = x1 = y0 = y1 = 0;
+
+  int w = x1 - x0 + 1, h = y1 - y0 + 1;
+  int transparent = own != NO_TRANSPARENT_COLOR ? own : spare;
+
+  for (int y = y0; transparent >= 0 && y <= y1; y++)
+    for (int x = x0 + 1; x <= x1; x++) {
+      int a = CHANGED(x - 1, y) ? cur[y * width + x - 1] : transparent;
+      int b = CHANGED(x, y) ? cur[y * width + x] : transparent;
+
+      changes += cur[y * width + x - 1] != cur[y * width + x];
+      changes_transparent += a != b;
+    }
+  // the pixels as they are show the same, transparent ones included
+  if (changes_transparent >= changes)
+    transparent = -1;
+
+  raster = malloc((size_t)w * h);
+  if (raster == NULL) {
+    fprintf(stderr, "Unable to allocate a frame of %d x %d\n", w, h);
+    return 0;
+  }
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int v = cur[(y0 + y) * width + x0 + x];
+      raster[y * w + x] =
+          transparent >= 0 && !CHANGED(x0 + x, y0 + y) ? transparent : v;
+    }
+#undef CHANGED
+#undef SHOWN
+
+  paint(c, g, i, own);
+  free(sp->RasterBits);
+  sp->RasterBits = raster;
+  sp->ImageDesc.Left += x0;
+  sp->ImageDesc.Top += y0;
+  sp->ImageDesc.Width = w;
+  sp->ImageDesc.Height = h;
+
+  if (transparent < 0 || transparent == own)
+    return 1;
+  gcb->TransparentColor = transparent;
+  return EGifGCBToSavedExtension(gcb, g, i) == GIF_OK;
+}
+
+/*
+ * Keep only what each frame changes on the screen as composed from the
+ * frames before it, following their transparency and disposal.
+ */
+static int diff_frames(GifFileType *g) {
+  size_t n = (size_t)g->SWidth * g->SHeight;
+  gif_canvas c = {malloc(sizeof(short) * n), malloc(sizeof(short) * n),
+                  g->SWidth, g->SHeight};
+  int spare = unused_color(g);
+  GraphicsControlBlock gcb;
+  int ok = c.colors != NULL && c.saved != NULL;
+
+  for (size_t j = 0; ok && j < n; j++)
+    c.colors[j] = -1;
+
+  for (int i = 0; ok && i < g->ImageCount; i++) {
+    const GifImageDesc *d = &g->SavedImages[i].ImageDesc;
+
+    DGifSavedExtensionToGCB(g, i, &gcb);
+    if (gcb.DisposalMode == DISPOSE_PREVIOUS)
+      memcpy(c.saved, c.colors, sizeof(short) * n);
+
+    if (i > 0 && croppable(g, i, &gcb))
+      ok = crop_frame(&c, g, i, &gcb, spare);
+    else
+      paint(&c, g, i, gcb.TransparentColor);
+
+    if (gcb.DisposalMode == DISPOSE_PREVIOUS)
+      memcpy(c.colors, c.saved, sizeof(short) * n);
+    else if (gcb.DisposalMode == DISPOSE_BACKGROUND)
+      for (int y = d->Top; y < d->Top + d->Height && y < c.height; y++)
+        for (int x = d->Left; x < d->Left + d->Width && x < c.width; x++)
+          if (x >= 0 && y >= 0)
+            c.colors[y * c.width + x] = -1;
+  }
+
+  if (c.colors == NULL || c.saved == NULL)
+    fprintf(stderr, "Unable to allocate the canvas of %d x %d\n", g->SWidth,
+            g->SHeight);
+  free(c.colors);
+  free(c.saved);
+  return ok;
+}
+
+/* Encode image into filename, or into mem when filename is NULL */
+static int store_pixels_to(char *filename, gif_membuf *mem,
+                           animated_gif *image, int frame_diff) {
+  double t = trace_now();
+  long n_pixels = 0;
+  GifFileType *g2;
+  perf_sample s;
+  int ok, error;
+
+  for (int i = 0; i < image->n_images; i++)
+    n_pixels += (long)image->width[i] * image->height[i];
+
+  perf_begin(&s);
+  if (!map_pixels(image))
+    return 0;
+  perf_end(&s, perf_palette, n_pixels);
+  trace_span("palette", -1, t);
+
+  if (frame_diff) {
+    t = trace_now();
+    ok = diff_frames(image->g);
+    trace_span("diff", -1, t);
+    if (!ok)
+      return 0;
+  }
+
+  /* Write the final image */
+  t = trace_now();
+  perf_begin(&s);
+  if (filename != NULL) {
+    ok = output_modified_read_gif(filename, image->g);
+  } else {
+    g2 = gif_mem_open_write(mem, &error);
+    ok = g2 != NULL && output_modified_gif(g2, image->g);
+    if (!ok) {
+      free(mem->data);
+      mem->data = NULL;
+    }
+  }
+  perf_end(&s, perf_lzw, n_pixels);
+  trace_span("encode", -1, t);
+  return ok;
+}
+
+int store_pixels(char *filename, animated_gif *image, int frame_diff) {
+  return store_pixels_to(filename, NULL, image, frame_diff);
+}
+
+int store_pixels_mem(gif_membuf *mem, animated_gif *image, int frame_diff) {
+  return store_pixels_to(NULL, mem, image, frame_diff);
+}
+
+/*
+ * Build the colormap of the filtered pixels and update the raster bits
+ * of image->g accordingly, so it is ready to be written.
+ */
+int map_pixels(animated_gif *image) {
   int n_colors = 0;
   pixel **p;
   int i, j, k;
@@ -440,7 +747,7 @@ int store_pixels(char *filename, animated_gif *image) {
            image->n_images, image->width[i], image->height[i]);
 #endif
 
-    for (j = 0; j < image->width[i] * image->height[i]; j++) {
+    for (size_t j = 0; j < (size_t)image->width[i] * image->height[i]; j++) {
       int found = 0;
       for (k = 0; k < n_colors; k++) {
         if (p[i][j].r == colormap[k].Red && p[i][j].g == colormap[k].Green &&
@@ -491,11 +798,12 @@ int store_pixels(char *filename, animated_gif *image) {
     return 0;
   }
 
+  GifFreeMapObject(image->g->SColorMap);
   image->g->SColorMap = cmo;
 
   /* Update the raster bits according to color map */
   for (i = 0; i < image->n_images; i++) {
-    for (j = 0; j < image->width[i] * image->height[i]; j++) {
+    for (size_t j = 0; j < (size_t)image->width[i] * image->height[i]; j++) {
       int found_index = -1;
       for (k = 0; k < n_colors; k++) {
         if (p[i][j].r == image->g->SColorMap->Colors[k].Red &&
@@ -514,10 +822,19 @@ int store_pixels(char *filename, animated_gif *image) {
     }
   }
 
-  /* Write the final image */
-  if (!output_modified_read_gif(filename, image->g)) {
-    return 0;
-  }
-
   return 1;
 }
+
+/*
+ * Release an animated_gif returned by load_pixels, including the
+ * internal GIF representation and its open file.
+ */
+void free_pixels(animated_gif *image) {
+  for (int i = 0; i < image->n_images; i++)
+    free(image->p[i]);
+  free(image->p);
+  free(image->width);
+  free(image->height);
+  DGifCloseFile(image->g, NULL);
+  free(image);
+}